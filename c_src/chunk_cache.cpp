@@ -0,0 +1,285 @@
+#include "chunk_cache.hpp"
+
+#include <cstdio>
+#include <cstring>
+#include <erl_nif.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <boost/shared_ptr.hpp>
+#include <boost/unordered_map.hpp>
+
+namespace lua {
+namespace chunk_cache {
+
+/////////////////////////////////////////////////////////////////////////////
+
+namespace {
+
+typedef boost::shared_ptr<std::string const> bytes_t;
+
+struct chunk_t
+{
+    std::string source; // compared on a hit, so a hash collision is harmless
+    bytes_t     bytecode;
+};
+
+struct file_t
+{
+    int64_t mtime;
+    off_t   size;
+    bytes_t bytecode;
+};
+
+ErlNifMutex * mutex_ = NULL;
+options_t     options_;
+std::size_t   bytes_ = 0;
+boost::unordered_map<uint64_t, chunk_t>     chunks_;
+boost::unordered_map<std::string, file_t>   files_;
+
+// FNV-1a, 64 bit.
+uint64_t hash(char const * data, std::size_t size, uint64_t seed = 14695981039346656037ULL)
+{
+    uint64_t result = seed;
+    for (std::size_t i = 0; i < size; ++i)
+    {
+        result ^= static_cast<unsigned char>(data[i]);
+        result *= 1099511628211ULL;
+    }
+    return result;
+}
+
+int writer(lua_State *, void const * p, std::size_t size, void * ud)
+{
+    static_cast<std::string*>(ud)->append(static_cast<char const*>(p), size);
+    return 0;
+}
+
+// Bytecode of the function on top of L.
+bytes_t dump(lua_State * L)
+{
+    std::string * bytecode = new std::string();
+    bytes_t result(bytecode);
+    if (lua_dump(L, writer, bytecode) != 0)
+    {
+        return bytes_t();
+    }
+    return result;
+}
+
+// Modification time in nanoseconds: whole seconds miss an edit made
+// within the same second that keeps the size.
+int64_t mtime(struct stat const& st)
+{
+    return static_cast<int64_t>(st.st_mtim.tv_sec) * 1000000000LL + st.st_mtim.tv_nsec;
+}
+
+// Makes room for size more bytes, under the lock; false if it never fits.
+bool reserve(std::size_t size)
+{
+    if (size > options_.max_bytes)
+    {
+        return false;
+    }
+    if (bytes_ + size > options_.max_bytes)
+    {
+        chunks_.clear();
+        files_.clear();
+        bytes_ = 0;
+    }
+    bytes_ += size;
+    return true;
+}
+
+/////////////////////////////////////////////////////////////////////////////
+// files kept in options_.dir:
+// "moon.chunk <mtime ns> <size> <path>\n" followed by the bytecode
+
+std::string persisted_path(std::string const& path)
+{
+    char name[32];
+    snprintf(name, sizeof(name), "/%016llx.luac", static_cast<unsigned long long>(hash(path.data(), path.size())));
+    return options_.dir + name;
+}
+
+std::string persisted_header(std::string const& path, struct stat const& st)
+{
+    char stamp[64];
+    snprintf(stamp, sizeof(stamp), "moon.chunk %lld %lld ",
+        static_cast<long long>(mtime(st)), static_cast<long long>(st.st_size));
+    return stamp + path + "\n";
+}
+
+bytes_t read_persisted(std::string const& path, struct stat const& st)
+{
+    FILE * file = fopen(persisted_path(path).c_str(), "rb");
+    if (!file)
+    {
+        return bytes_t();
+    }
+    std::string content;
+    char buffer[16384];
+    std::size_t n;
+    while ((n = fread(buffer, 1, sizeof(buffer), file)) > 0)
+    {
+        content.append(buffer, n);
+    }
+    fclose(file);
+
+    std::string header = persisted_header(path, st);
+    if (content.compare(0, header.size(), header) != 0)
+    {
+        return bytes_t(); // stale, or another path with the same hash
+    }
+    return bytes_t(new std::string(content, header.size()));
+}
+
+// Written aside and renamed, so that readers never see half a file.
+void write_persisted(std::string const& path, struct stat const& st, std::string const& bytecode)
+{
+    std::string target = persisted_path(path);
+    char suffix[32];
+    snprintf(suffix, sizeof(suffix), ".%ld.tmp", static_cast<long>(getpid()));
+    std::string temp = target + suffix;
+
+    FILE * file = fopen(temp.c_str(), "wb");
+    if (!file)
+    {
+        return;
+    }
+    std::string header = persisted_header(path, st);
+    bool ok = fwrite(header.data(), 1, header.size(), file) == header.size()
+           && fwrite(bytecode.data(), 1, bytecode.size(), file) == bytecode.size();
+    ok = (fclose(file) == 0) && ok;
+    if (!ok || rename(temp.c_str(), target.c_str()) != 0)
+    {
+        unlink(temp.c_str());
+    }
+}
+
+}
+
+/////////////////////////////////////////////////////////////////////////////
+
+void init(options_t const& options)
+{
+    options_ = options;
+    if (!mutex_)
+    {
+        mutex_ = enif_mutex_create(const_cast<char*>("moon.chunk_cache"));
+    }
+}
+
+int load_buffer(lua_State * L, char const * code, std::size_t size, char const * name)
+{
+    if (!mutex_ || (size > 0 && code[0] == LUA_SIGNATURE[0]))
+    {
+        return luaL_loadbuffer(L, code, size, name); // already bytecode
+    }
+
+    uint64_t key = hash(code, size, hash(name, strlen(name)));
+    bytes_t bytecode;
+    enif_mutex_lock(mutex_);
+    boost::unordered_map<uint64_t, chunk_t>::const_iterator it = chunks_.find(key);
+    if (it != chunks_.end() && it->second.source.size() == size
+        && memcmp(it->second.source.data(), code, size) == 0)
+    {
+        bytecode = it->second.bytecode;
+    }
+    enif_mutex_unlock(mutex_);
+
+    if (bytecode)
+    {
+        return luaL_loadbuffer(L, bytecode->data(), bytecode->size(), name);
+    }
+
+    int status = luaL_loadbuffer(L, code, size, name);
+    if (status == 0 && (bytecode = dump(L)))
+    {
+        enif_mutex_lock(mutex_);
+        if (reserve(size + bytecode->size()))
+        {
+            chunk_t & chunk = chunks_[key];
+            chunk.source.assign(code, size);
+            chunk.bytecode = bytecode;
+        }
+        enif_mutex_unlock(mutex_);
+    }
+    return status;
+}
+
+int load_file(lua_State * L, char const * path)
+{
+    struct stat st;
+    if (!mutex_ || stat(path, &st) != 0 || !S_ISREG(st.st_mode))
+    {
+        return luaL_loadfile(L, path); // reports the error as usual
+    }
+
+    std::string const file(path);
+    std::string const name = "@" + file;
+    bytes_t bytecode;
+    enif_mutex_lock(mutex_);
+    boost::unordered_map<std::string, file_t>::const_iterator it = files_.find(file);
+    if (it != files_.end() && it->second.mtime == mtime(st) && it->second.size == st.st_size)
+    {
+        bytecode = it->second.bytecode;
+    }
+    enif_mutex_unlock(mutex_);
+
+    bool persisted = false;
+    if (!bytecode && !options_.dir.empty())
+    {
+        bytecode = read_persisted(file, st);
+        persisted = bytecode.get() != NULL;
+    }
+
+    if (bytecode)
+    {
+        if (luaL_loadbuffer(L, bytecode->data(), bytecode->size(), name.c_str()) == 0)
+        {
+            if (!persisted)
+            {
+                return 0;
+            }
+        }
+        else
+        {
+            lua_pop(L, 1); // built by another LuaJIT; compile it again
+            bytecode.reset();
+            persisted = false;
+        }
+    }
+
+    if (!bytecode)
+    {
+        int status = luaL_loadfile(L, path);
+        if (status != 0 || !(bytecode = dump(L)))
+        {
+            return status;
+        }
+        if (!options_.dir.empty())
+        {
+            write_persisted(file, st, *bytecode);
+        }
+    }
+
+    enif_mutex_lock(mutex_);
+    it = files_.find(file);
+    if (it != files_.end())
+    {
+        bytes_ -= it->second.bytecode->size(); // an older version
+        files_.erase(file);
+    }
+    if (reserve(bytecode->size()))
+    {
+        file_t & entry = files_[file];
+        entry.mtime = mtime(st);
+        entry.size = st.st_size;
+        entry.bytecode = bytecode;
+    }
+    enif_mutex_unlock(mutex_);
+    return 0;
+}
+
+}
+}
@@ -0,0 +1,35 @@
+#pragma once
+
+#include <string>
+#include <lua.hpp>
+
+namespace lua {
+namespace chunk_cache {
+
+// Compiled chunks (string.dump bytecode) shared by every VM of the node,
+// so a script is parsed once instead of once per VM and per eval.
+
+struct options_t
+{
+    options_t() : max_bytes(64 * 1024 * 1024) {}
+    // compiled files are also kept here and reused across restarts as long
+    // as they are newer than their source ("" = memory only)
+    std::string dir;
+    // in-memory budget; the cache starts over when it is exceeded
+    std::size_t max_bytes;
+};
+
+// The cache lives as long as the process: VMs that outlive the module
+// still load chunks through it, so there is no shutdown.
+void init(options_t const& options);
+
+// Drop-in for luaL_loadbuffer: chunks are keyed by a hash of name and
+// code, and a hit loads the stored bytecode instead of the source.
+int load_buffer(lua_State * L, char const * code, std::size_t size, char const * name);
+
+// Drop-in for luaL_loadfile: files are keyed by path and revalidated by
+// mtime (to the nanosecond) and size, without reading the source on a hit.
+int load_file(lua_State * L, char const * path);
+
+}
+}
@@ -45,6 +45,7 @@
 
 #include "strbuf.h"
 #include "fpconv.h"
+#include "../moon_buffer.h"
 
 #ifndef CJSON_MODNAME
 #define CJSON_MODNAME   "cjson"
@@ -1257,7 +1258,18 @@ static int json_decode(lua_State *l)
     luaL_argcheck(l, lua_gettop(l) == 1, 1, "expected 1 argument");
 
     json.cfg = json_fetch_config(l);
-    json.data = luaL_checklstring(l, 1, &json_len);
+    if (lua_type(l, 1) == LUA_TSTRING) {
+        json.data = lua_tolstring(l, 1, &json_len);
+    } else {
+        /* A moon.buffer is not NUL terminated, which the parser relies
+         * on: parse a terminated scratch copy (never interned as a Lua
+         * string, and collected with the stack if decoding fails). */
+        const char *buffer = moon_checklbuffer(l, 1, &json_len);
+        char *copy = lua_newuserdata(l, json_len + 1);
+        memcpy(copy, buffer, json_len);
+        copy[json_len] = '\0';
+        json.data = copy;
+    }
     json.current_depth = 0;
     json.ptr = json.data;
 
@@ -2,9 +2,12 @@
 #include "utils.hpp"
 #include "errors.hpp"
 #include "lua_utils.hpp"
+#include "chunk_cache.hpp"
 
-#include <dlfcn.h>
+#include <new>
+#include <time.h>
 #include <unistd.h>
+#include <luajit.h>
 
 extern "C"
 {
@@ -37,7 +40,9 @@ public :
     virtual return_type operator()(vm_t::tasks::load_t const&) { throw errors::unexpected_msg(); }
     virtual return_type operator()(vm_t::tasks::eval_t const&) { throw errors::unexpected_msg(); }
     virtual return_type operator()(vm_t::tasks::call_t const&) { throw errors::unexpected_msg(); }
+    virtual return_type operator()(vm_t::tasks::call_batch_t const&) { throw errors::unexpected_msg(); }
     virtual return_type operator()(vm_t::tasks::resp_t const&) { throw errors::unexpected_msg(); }
+    virtual return_type operator()(vm_t::tasks::cancel_t const&) { throw errors::unexpected_msg(); }
     virtual return_type operator()(vm_t::tasks::quit_t const&) { throw quit_tag(); }
 
     vm_t & vm() { return vm_; };
@@ -52,13 +57,172 @@ private :
 
 /////////////////////////////////////////////////////////////////////////////
 
-class result_handler : public base_handler<erlcpp::term_t>
+static ERL_NIF_TERM make_result(ErlNifEnv * env, ERL_NIF_TERM tag, ERL_NIF_TERM value)
 {
-public :
-    using base_handler<erlcpp::term_t>::operator();
-    result_handler(vm_t & vm) : base_handler<erlcpp::term_t>(vm) {};
-    erlcpp::term_t operator()(vm_t::tasks::resp_t const& resp) { vm().cur_caller = resp.caller; return resp.term; }
-};
+    return enif_make_tuple2(env, tag, value);
+}
+
+// Pops the error of a failed pcall/resume on thread L, reporting aborted
+// calls as 'timeout'.
+static ERL_NIF_TERM pop_error(vm_t & vm, lua_State * L, ErlNifEnv * env)
+{
+    if (vm.budget_exceeded())
+    {
+        lua_pop(L, 1);
+        return atoms::timeout;
+    }
+    return lua::stack::pop(env, L);
+}
+
+static void push_traceback(vm_t & vm)
+{
+    lua_rawgeti( vm.state(), LUA_REGISTRYINDEX, vm.traceback_ref() );
+}
+
+// Pushes the function call runs onto L.
+static void push_function(lua_State * L, vm_t::tasks::call_t const& call)
+{
+    if (call.prepared)
+    {
+        lua_rawgeti(L, LUA_REGISTRYINDEX, call.prepared->ref);
+    }
+    else
+    {
+        lua_getglobal(L, call.fun.c_str());
+    }
+}
+
+// Runs call with the error handler found at stack index errfunc and
+// encodes its outcome in env; the stack is left as it was found.
+ERL_NIF_TERM call_function(vm_t & vm, vm_t::tasks::call_t const& call, int errfunc, ErlNifEnv * env)
+{
+    stack_guard_t guard(vm);
+    try
+    {
+        int top = lua_gettop(vm.state());
+
+        push_function(vm.state(), call);
+
+        int nargs = lua::stack::push_all(vm.state(), call.env.get(), call.args, &vm);
+
+        budget_guard_t budget(vm, vm.state());
+        if (lua_pcall(vm.state(), nargs, LUA_MULTRET, errfunc))
+        {
+            return make_result(env, atoms::error_lua, pop_error(vm, vm.state(), env));
+        }
+        else
+        {
+            return make_result(env, atoms::ok, lua::stack::pop_all(env, vm.state(), top, vm.return_maps()));
+        }
+    }
+    catch( std::exception & ex )
+    {
+        return make_result(env, atoms::error_lua, enif_make_atom(env, ex.what()));
+    }
+}
+
+// Runs call on the VM's state; shared by the queued and the synchronous path.
+ERL_NIF_TERM call_function(vm_t & vm, vm_t::tasks::call_t const& call, ErlNifEnv * env)
+{
+    stack_guard_t guard(vm);
+    push_traceback(vm);
+    return call_function(vm, call, lua_gettop(vm.state()), env);
+}
+
+/////////////////////////////////////////////////////////////////////////////
+
+template <class task_t>
+static bool is_async(task_t const&) { return false; }
+static bool is_async(vm_t::tasks::call_t const& call) { return call.async; }
+
+template <class task_t>
+static vm_t::coroutine_t new_coroutine(vm_t & vm, task_t const& task, bool traceback)
+{
+    vm_t::coroutine_t co;
+    co.thread = lua_newthread(vm.state());
+    co.ref = luaL_ref(vm.state(), LUA_REGISTRYINDEX);
+    co.caller = task.caller;
+    co.env = task.env;
+    co.reply = task.ref;
+    co.traceback = traceback;
+    co.async = is_async(task);
+    co.instructions = 0;
+    co.cpu_time = 0;
+    return co;
+}
+
+// Pops the error left on a dead coroutine, with the traceback of its stack.
+static ERL_NIF_TERM pop_traceback(vm_t & vm, vm_t::coroutine_t const& co, ErlNifEnv * env)
+{
+    if (vm.budget_exceeded() || !co.traceback)
+    {
+        return pop_error(vm, co.thread, env);
+    }
+
+    stack_guard_t guard(vm);
+    push_traceback(vm);
+    lua_rawgeti(vm.state(), LUA_REGISTRYINDEX, co.ref);
+    lua_xmove(co.thread, vm.state(), 1);
+    if (lua_pcall(vm.state(), 2, 1, 0))
+    {
+        // fall back to whatever the traceback handler left us
+    }
+    return lua::stack::pop(env, vm.state());
+}
+
+// Resumes co with nargs values pushed on its stack. A coroutine yielding
+// in erlang.call is parked until its reply arrives; otherwise the outcome
+// is sent to the caller and the coroutine is released.
+static void resume(vm_t & vm, vm_t::coroutine_t co, int nargs)
+{
+    vm.cur_caller = co.caller;
+    vm.cur_ref = co.reply;
+    vm.cur_async = co.async;
+
+    boost::shared_ptr<ErlNifEnv> env(enif_alloc_env(), enif_free_env);
+    ERL_NIF_TERM result;
+    try
+    {
+        int status = 0;
+        {
+            budget_guard_t budget(vm, co);
+            vm.yield_request = 0;
+            vm.set_task_thread(co.thread);
+            status = lua_resume(co.thread, nargs);
+            vm.set_task_thread(NULL);
+        }
+
+        if (status == LUA_YIELD && vm.yield_request)
+        {
+            vm.suspend(vm.yield_request, co);
+            return;
+        }
+
+        if (status == LUA_YIELD)
+        {
+            // a bare coroutine.yield() at task level has nothing to wait for
+            result = make_result(env.get(), atoms::error_lua,
+                erlcpp::to_erl(env.get(), erlcpp::binary_t(std::string("attempt to yield from a task"))));
+        }
+        else if (status == 0)
+        {
+            result = make_result(env.get(), atoms::ok, lua::stack::pop_all(env.get(), co.thread, 0, vm.return_maps()));
+        }
+        else
+        {
+            result = make_result(env.get(), atoms::error_lua, pop_traceback(vm, co, env.get()));
+        }
+    }
+    catch( std::exception & ex )
+    {
+        result = make_result(env.get(), atoms::error_lua, enif_make_atom(env.get(), ex.what()));
+    }
+
+    luaL_unref(vm.state(), LUA_REGISTRYINDEX, co.ref);
+    send_result_caller(vm, atoms::moon_response, env.get(), result, co.caller, co.reply);
+}
+
+/////////////////////////////////////////////////////////////////////////////
 
 struct call_handler : public base_handler<void>
 {
@@ -68,22 +232,29 @@ struct call_handler : public base_handler<void>
     // Loading file:
     void operator()(vm_t::tasks::load_t const& load)
     {
+        if (vm().expired(load.deadline, load.ref)) return; // the caller gave up already
         vm().cur_caller = load.caller;
         stack_guard_t guard(vm());
         try
         {
-            std::string file(load.file.data(), load.file.data() + load.file.size());
-            if (luaL_dofile(vm().state(), file.c_str()))
+            ErlNifBinary bin;
+            if (!enif_inspect_binary(load.env.get(), load.file, &bin))
+            {
+                throw errors::invalid_type("binary");
+            }
+            std::string file(bin.data, bin.data + bin.size);
+            if (chunk_cache::load_file(vm().state(), file.c_str())
+                || lua_pcall(vm().state(), 0, LUA_MULTRET, 0))
             {
                 erlcpp::tuple_t result(2);
                 result[0] = erlcpp::atom_t("error_lua");
                 result[1] = lua::stack::pop(vm().state());
-                send_result_caller(vm(), "moon_response", result, load.caller);
+                send_result_caller(vm(), "moon_response", result, load.caller, load.ref);
             }
             else
             {
                 erlcpp::atom_t result("ok");
-                send_result_caller(vm(), "moon_response", result, load.caller);
+                send_result_caller(vm(), "moon_response", result, load.caller, load.ref);
             }
         }
         catch( std::exception & ex )
@@ -91,102 +262,238 @@ struct call_handler : public base_handler<void>
             erlcpp::tuple_t result(2);
             result[0] = erlcpp::atom_t("error_lua");
             result[1] = erlcpp::atom_t(ex.what());
-            send_result_caller(vm(), "moon_response", result, load.caller);
+            send_result_caller(vm(), "moon_response", result, load.caller, load.ref);
         }
     }
 
     // Evaluating arbitrary code:
     void operator()(vm_t::tasks::eval_t const& eval)
     {
+        if (vm().expired(eval.deadline, eval.ref)) return;
         vm().cur_caller = eval.caller;
         stack_guard_t guard(vm());
-        try
+        ErlNifBinary code;
+        if (!enif_inspect_binary(eval.env.get(), eval.code, &code))
+        {
+            erlcpp::tuple_t result(2);
+            result[0] = erlcpp::atom_t("error_lua");
+            result[1] = erlcpp::atom_t("badarg");
+            send_result_caller(vm(), "moon_response", result, eval.caller, eval.ref);
+            return;
+        }
+        vm_t::coroutine_t co = new_coroutine(vm(), eval, false);
+        if (chunk_cache::load_buffer(co.thread, reinterpret_cast<char const*>(code.data), code.size, "line"))
         {
-            if ( luaL_loadbuffer(vm().state(), eval.code.data(), eval.code.size(), "line") ||
-                    lua_pcall(vm().state(), 0, LUA_MULTRET, 0) )
+            erlcpp::tuple_t result(2);
+            result[0] = erlcpp::atom_t("error_lua");
+            result[1] = lua::stack::pop(co.thread);
+            luaL_unref(vm().state(), LUA_REGISTRYINDEX, co.ref);
+            send_result_caller(vm(), "moon_response", result, eval.caller, eval.ref);
+            return;
+        }
+        if (eval.bindings)
+        {
+            // the cached chunk stays the same whatever the values are
+            try
             {
-                erlcpp::tuple_t result(2);
-                result[0] = erlcpp::atom_t("error_lua");
-                result[1] = lua::stack::pop(vm().state());
-                send_result_caller(vm(), "moon_response", result, eval.caller);
+                lua::stack::push(co.thread, eval.env.get(), eval.bindings, &vm());
             }
-            else
+            catch( std::exception & ex )
             {
                 erlcpp::tuple_t result(2);
-                result[0] = erlcpp::atom_t("ok");
-                result[1] = lua::stack::pop_all(vm().state());
-                send_result_caller(vm(), "moon_response", result, eval.caller);
+                result[0] = erlcpp::atom_t("error_lua");
+                result[1] = erlcpp::atom_t(ex.what());
+                luaL_unref(vm().state(), LUA_REGISTRYINDEX, co.ref);
+                send_result_caller(vm(), "moon_response", result, eval.caller, eval.ref);
+                return;
             }
+            lua_rawgeti(co.thread, LUA_REGISTRYINDEX, vm().bindings_mt_ref());
+            lua_setmetatable(co.thread, -2);
+            lua_setfenv(co.thread, -2);
+        }
+        resume(vm(), co, 0);
+    }
+
+    // Calling arbitrary function:
+    void operator()(vm_t::tasks::call_t const& call)
+    {
+        if (vm().expired(call.deadline, call.ref)) return;
+        vm().cur_caller = call.caller;
+        stack_guard_t guard(vm());
+        vm_t::coroutine_t co = new_coroutine(vm(), call, true);
+        int nargs = 0;
+        try
+        {
+            push_function(co.thread, call);
+            nargs = lua::stack::push_all(co.thread, call.env.get(), call.args, &vm());
         }
         catch( std::exception & ex )
         {
             erlcpp::tuple_t result(2);
             result[0] = erlcpp::atom_t("error_lua");
             result[1] = erlcpp::atom_t(ex.what());
-            send_result_caller(vm(), "moon_response", result, eval.caller);
+            luaL_unref(vm().state(), LUA_REGISTRYINDEX, co.ref);
+            send_result_caller(vm(), "moon_response", result, call.caller, call.ref);
+            return;
         }
+        resume(vm(), co, nargs);
     }
 
-    // Calling arbitrary function:
-    void operator()(vm_t::tasks::call_t const& call)
+    // Reply to the erlang.call of a suspended coroutine:
+    void operator()(vm_t::tasks::resp_t const& resp)
     {
-        vm().cur_caller = call.caller;
-        stack_guard_t guard(vm());
+        boost::optional<vm_t::coroutine_t> co = vm().take_suspended(resp.id);
+        if (!co)
+        {
+            return; // nobody is waiting for it any more
+        }
+        int top = lua_gettop(co->thread);
         try
         {
-			lua_getglobal( vm().state(), "debug" );
-			lua_getfield( vm().state(), -1, "traceback" );
-			lua_remove( vm().state(), -2 );
-			
+            lua::stack::push(co->thread, resp.env.get(), resp.term, &vm());
+        }
+        catch( std::exception & ex )
+        {
+            // an unconvertible reply still has to wake the coroutine up
+            lua_settop(co->thread, top);
+            erlcpp::tuple_t error(2), reason(2);
+            error[0] = erlcpp::atom_t("error");
+            error[1] = erlcpp::atom_t("true");
+            reason[0] = erlcpp::atom_t("result");
+            reason[1] = erlcpp::atom_t(ex.what());
+            erlcpp::list_t result;
+            result.push_back(error);
+            result.push_back(reason);
+            lua::stack::push(co->thread, result);
+        }
+        resume(vm(), *co, 1);
+    }
+
+    // The caller timed out; its callbacks will never be answered:
+    void operator()(vm_t::tasks::cancel_t const& cancel)
+    {
+        vm().cancel(cancel);
+    }
 
-            lua_getglobal(vm().state(), call.fun.c_str());
+    // Calling many functions back-to-back, answering with one message:
+    void operator()(vm_t::tasks::call_batch_t const& batch)
+    {
+        if (vm().expired(batch.deadline, batch.ref)) return;
+        vm().cur_caller = batch.caller;
+        stack_guard_t guard(vm());
 
-            lua::stack::push_all(vm().state(), call.args);
+        push_traceback(vm());
+        int errfunc = lua_gettop(vm().state());
 
-            if (lua_pcall(vm().state(), call.args.size(), LUA_MULTRET, -2-call.args.size()))
-            //if (lua_pcall(vm().state(), call.args.size(), LUA_MULTRET, 0))
+        boost::shared_ptr<ErlNifEnv> env(enif_alloc_env(), enif_free_env);
+        std::vector<ERL_NIF_TERM> results;
+        unsigned length = 0;
+        enif_get_list_length(batch.env.get(), batch.calls, &length);
+        results.reserve(length);
+        ERL_NIF_TERM head, tail = batch.calls;
+        while(enif_get_list_cell(batch.env.get(), tail, &head, &tail))
+        {
+            // the shape was checked by moon_nif:call_batch
+            int arity = 0;
+            ERL_NIF_TERM const* call;
+            enif_get_tuple(batch.env.get(), head, &arity, &call);
+            try
             {
-                erlcpp::tuple_t result(2);
-                result[0] = erlcpp::atom_t("error_lua");
-                result[1] = lua::stack::pop(vm().state());
-                send_result_caller(vm(), "moon_response", result, call.caller);
+                boost::shared_ptr<vm_t::prepared_t> prepared = vm().get_prepared(batch.env.get(), call[0]);
+                vm_t::tasks::call_t task = prepared
+                    ? vm_t::tasks::call_t(prepared, batch.env, call[1], batch.caller)
+                    : vm_t::tasks::call_t(erlcpp::from_erl<erlcpp::atom_t>(batch.env.get(), call[0]),
+                                          batch.env, call[1], batch.caller);
+                results.push_back(call_function(vm(), task, errfunc, env.get()));
             }
-            else
+            catch( std::exception & ex )
             {
-                erlcpp::tuple_t result(2);
-                result[0] = erlcpp::atom_t("ok");
-				lua_remove(vm().state(), 1);
-                result[1] = lua::stack::pop_all(vm().state());
-                send_result_caller(vm(), "moon_response", result, call.caller);
+                results.push_back(make_result(env.get(), atoms::error_lua, enif_make_atom(env.get(), ex.what())));
             }
         }
-        catch( std::exception & ex )
-        {
-            erlcpp::tuple_t result(2);
-            result[0] = erlcpp::atom_t("error_lua");
-            result[1] = erlcpp::atom_t(ex.what());
-            send_result_caller(vm(), "moon_response", result, call.caller);
-        }
+
+        ERL_NIF_TERM result = make_result(env.get(), atoms::ok,
+            enif_make_list_from_array(env.get(), results.data(), results.size()));
+        send_result_caller(vm(), atoms::moon_response, env.get(), result, batch.caller, batch.ref);
     }
 };
 
 /////////////////////////////////////////////////////////////////////////////
 /////////////////////////////////////////////////////////////////////////////
 
-int erlang_call(vm_t & vm)
+// Whether erlang.call, the C function at level 0 of L, can yield: LuaJIT
+// cannot yield across another C frame (a table.sort comparator, a gsub
+// callback, ...), and the yield would fail only after the callback went
+// out. pcall frames count as such too, to be safe.
+static bool yieldable(lua_State * L)
+{
+    lua_Debug ar;
+    for (int level = 1; lua_getstack(L, level, &ar); ++level)
+    {
+        lua_getinfo(L, "S", &ar);
+        if (ar.what[0] == 'C')
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+int erlang_call(vm_t & vm, lua_State * L)
 {
+    // a call that keeps calling back may never run long enough in between
+    // to reach the count hook
+    if (vm.check_budget())
+    {
+        lua_pushliteral(L, "timeout");
+        return lua_error(L);
+    }
+    // nobody would run the callback of a task its caller gave up on
+    if (L == vm.task_thread() && vm.cancelled(vm.cur_ref))
+    {
+        lua_pushliteral(L, "timeout");
+        return lua_error(L);
+    }
+
     bool exception_caught = false; // because lua_error makes longjump
     try
     {
-        stack_guard_t guard(vm);
+        stack_guard_t guard(L);
 
-        erlcpp::term_t args = lua::stack::pop_all(vm.state());
-        
-        if (send_result_vm_with_caller(vm, "moon_callback", args, vm.cur_caller)) {
-            erlcpp::term_t result = perform_resp_task<result_handler>(vm);
-            lua::stack::push(vm.state(), result);
+        boost::shared_ptr<ErlNifEnv> env(enif_alloc_env(), enif_free_env);
+        ERL_NIF_TERM args = lua::stack::pop_all(env.get(), L, 0, vm.return_maps());
+
+        // only the task's own coroutine can be parked, and only when no C
+        // function sits in between; anything else (a coroutine created by
+        // the script, call_sync, batches, load) waits
+        bool yield = L == vm.task_thread() && yieldable(L);
+        uint64_t id = vm.new_request();
+        if (yield) {
+            vm.expect_resume(id);
         } else {
-            lua::stack::push(vm.state(), erlcpp::binary_t("send_moon_callback_fail"));
+            vm.expect_response(id);
+        }
+
+        // a parked task's callback is run by its caller, which waits in a
+        // receive; the VM owner runs the rest: blocking ones (the caller may
+        // be stuck in call_sync) and those of call_async, whose caller may
+        // not await for a long while
+        int sent = yield && !vm.cur_async
+            ? send_callback_caller(vm, atoms::moon_callback, env.get(), args, vm.cur_caller, vm.cur_ref, id)
+            : send_result_vm_with_caller(vm, atoms::moon_callback, env.get(), args, vm.cur_caller, id);
+        if (sent) {
+            if (yield) {
+                guard.dismiss();
+                vm.yield_request = id;
+                return lua_yield(L, 0);
+            }
+            vm_t::task_t task = vm.get_resp_task(id);
+            vm_t::tasks::resp_t const& resp = boost::get<vm_t::tasks::resp_t>(task);
+            vm.cur_caller = resp.caller;
+            lua::stack::push(L, resp.env.get(), resp.term, &vm);
+        } else {
+            vm.cancel_request(id);
+            lua::stack::push(L, erlcpp::binary_t("send_moon_callback_fail"));
         }
 
         guard.dismiss();
@@ -194,12 +501,12 @@ int erlang_call(vm_t & vm)
     }
     catch(std::exception & ex)
     {
-        lua::stack::push(vm.state(), erlcpp::atom_t(ex.what()));
+        lua::stack::push(L, erlcpp::atom_t(ex.what()));
         exception_caught = true;
     }
 
     if (exception_caught) {
-        lua_error(vm.state());
+        lua_error(L);
     }
 
     return 0;
@@ -236,7 +543,7 @@ extern "C"
         assert(lua_islightuserdata(vm, index));
         void * data = lua_touserdata(vm, index);
         assert(data);
-        return erlang_call(*static_cast<vm_t*>(data));
+        return erlang_call(*static_cast<vm_t*>(data), vm);
     }
 
     static const struct luaL_Reg erlang_lib[] =
@@ -247,41 +554,271 @@ extern "C"
     };
 }
 
-vm_t::vm_t(erlcpp::lpid_t const& pid)
-    : pid_(pid)
-    , luastate_(luaL_newstate(), lua_close)
+/////////////////////////////////////////////////////////////////////////////
+
+// Libraries a VM opens only when a script needs them: they are registered
+// in package.preload, and the first use of their global opens them too.
+struct lib_t
 {
-	stack_guard_t guard(*this);
+    char const *  name;   // for require
+    lua_CFunction open;
+    // a placeholder until opened, then what the library registered under
+    // that name itself, or else its module (NULL: require only)
+    char const *  global;
+};
 
-//	char ff[256] = {0,};
-//	getcwd(ff, 256);
-//
-//	printf("%s\n", "11111111111111111111111");
-//	printf("%s\n", ff);
+static const lib_t libs[] =
+{
+    {LUA_IOLIBNAME,  luaopen_io,          "io"},
+    {LUA_OSLIBNAME,  luaopen_os,          "os"},
+    {LUA_FFILIBNAME, luaopen_ffi,         NULL},
+    {"cjson",        luaopen_cjson,       "cjson"},
+    {"cjson.safe",   luaopen_cjson_safe,  "cjson_safe"},
+    {"LuaXML_lib",   luaopen_LuaXML_lib,  "xml"},
+    {"socket.core",  luaopen_socket_core, "luasocket"},
+    {"protobuf.c",   luaopen_protobuf_c,  "protobuf"}, // registers protobuf.c
+    {NULL, NULL, NULL}
+};
 
-    struct timeval tp;
-    gettimeofday(&tp, NULL);
+static lib_t const * find_lib(std::string const& name)
+{
+    for (lib_t const * lib = libs; lib->name; ++lib)
+    {
+        if (name == lib->name || (lib->global && name == lib->global))
+        {
+            return lib;
+        }
+    }
+    return NULL;
+}
 
-    int end_time = 1511758208 + (180 * 24 * 3600);
-    printf("ggg:%d\n", tp.tv_sec);
-    if (tp.tv_sec >= end_time) {
-        assert(false);
+bool vm_t::known_lib(std::string const& name)
+{
+    return find_lib(name) != NULL;
+}
+
+extern "C"
+{
+    static int lazy_lib(lua_State * L);
+
+    static bool is_placeholder(lua_State * L, int index)
+    {
+        if (!lua_getmetatable(L, index)) return false;
+        lua_getfield(L, -1, "__index");
+        bool result = lua_tocfunction(L, -1) == lazy_lib;
+        lua_pop(L, 2);
+        return result;
     }
 
-	void* handle = dlopen("/usr/local/lib/libluajit-5.1.so", RTLD_NOW | RTLD_GLOBAL); 	
-	assert(handle != NULL);
+    // open_lib(name, global): require(name), then set global to the module
+    // unless the library registered something there itself. The
+    // placeholder is taken out meanwhile, or luaL_register would fill it.
+    static int open_lib(lua_State * L)
+    {
+        lua_settop(L, 2);
+        bool global = !lua_isnil(L, 2);
+        bool placeholder = false;
+        if (global)
+        {
+            lua_pushvalue(L, 2);
+            lua_rawget(L, LUA_GLOBALSINDEX);    // 3
+            placeholder = is_placeholder(L, 3);
+            if (placeholder)
+            {
+                lua_pushvalue(L, 2);
+                lua_pushnil(L);
+                lua_rawset(L, LUA_GLOBALSINDEX);
+            }
+        }
 
-	luaL_openlibs(luastate_.get());
-	luaopen_debug(luastate_.get());
+        lua_pushliteral(L, "require");
+        lua_rawget(L, LUA_GLOBALSINDEX);
+        lua_pushvalue(L, 1);
+        if (lua_pcall(L, 1, 1, 0))
+        {
+            if (placeholder)
+            {
+                lua_pushvalue(L, 2);
+                lua_pushvalue(L, 3);
+                lua_rawset(L, LUA_GLOBALSINDEX);
+            }
+            return lua_error(L);
+        }
 
-	luaopen_cjson(luastate_.get());
-	luaopen_cjson_safe(luastate_.get());
+        if (global)
+        {
+            lua_pushvalue(L, 2);
+            lua_rawget(L, LUA_GLOBALSINDEX);
+            bool registered = !lua_isnil(L, -1);
+            lua_pop(L, 1);
+            if (!registered)
+            {
+                lua_pushvalue(L, 2);
+                lua_pushvalue(L, -2);
+                lua_rawset(L, LUA_GLOBALSINDEX);
+            }
+        }
+        return 1;
+    }
 
-	luaopen_LuaXML_lib(luastate_.get());
+    // __index/__newindex of the placeholder a library global starts as;
+    // upvalues: name, global. Opens the library, which replaces the global,
+    // and points the placeholder at it for code that kept a reference.
+    static int lazy_lib(lua_State * L)
+    {
+        int top = lua_gettop(L);
+        lua_pushcfunction(L, open_lib);
+        lua_pushvalue(L, lua_upvalueindex(1));
+        lua_pushvalue(L, lua_upvalueindex(2));
+        lua_call(L, 2, 0);
+        lua_pushvalue(L, lua_upvalueindex(2));
+        lua_rawget(L, LUA_GLOBALSINDEX);
+        if (!lua_istable(L, -1))
+        {
+            return luaL_error(L, "cannot open library '%s'", lua_tostring(L, lua_upvalueindex(1)));
+        }
+        lua_getmetatable(L, 1);
+        lua_pushvalue(L, -2);
+        lua_setfield(L, -2, "__index");
+        lua_pushvalue(L, -2);
+        lua_setfield(L, -2, "__newindex");
+        lua_pop(L, 1);
 
-	luaopen_socket_core(luastate_.get());	
-	
-	luaopen_protobuf_c(luastate_.get());
+        lua_pushvalue(L, 2);
+        if (top > 2)
+        {
+            lua_pushvalue(L, 3);
+            lua_settable(L, -3);
+            return 0;
+        }
+        lua_gettable(L, -2);
+        return 1;
+    }
+}
+
+// Opens lib, leaving any error to happen again on its first use.
+static void open_lib_now(lua_State * L, lib_t const * lib)
+{
+    lua_pushcfunction(L, open_lib);
+    lua_pushstring(L, lib->name);
+    if (lib->global) {
+        lua_pushstring(L, lib->global);
+    } else {
+        lua_pushnil(L);
+    }
+    if (lua_pcall(L, 2, 0, 0)) {
+        lua_pop(L, 1);
+    }
+}
+
+static void open_core(lua_State * L, lua_CFunction open, char const * name)
+{
+    lua_pushcfunction(L, open);
+    lua_pushstring(L, name);
+    lua_call(L, 1, 0);
+}
+
+vm_t::vm_t(erlcpp::lpid_t const& pid, options_t const& options)
+    : cur_ref(0)
+    , cur_async(false)
+    , yield_request(0)
+    , pid_(pid)
+    , exec_mutex_(enif_mutex_create(const_cast<char*>("moon.vm.exec")))
+    , options_(options)
+    , scheduler_(options.scheduler)
+    , scheduled_(false)
+    , luastate_(luaL_newstate(), lua_close)
+    , queue_(options.queue_size)
+    , internal_mutex_(enif_mutex_create(const_cast<char*>("moon.vm.internal")))
+    , internal_size_(0)
+    , serving_since_(0)
+    , parked_(0)
+    , high_water_(0)
+    , overloaded_(0)
+    , expired_(0)
+    , busy_time_(0)
+    , tasks_(0)
+    , running_(0)
+    , locked_since_(0)
+    , resp_queue_(16)
+    , task_thread_(NULL)
+    , next_request_(0)
+    , suspended_count_(0)
+    , resume_mutex_(enif_mutex_create(const_cast<char*>("moon.vm.resume")))
+    , awaited_(0)
+    , traceback_ref_(LUA_NOREF)
+    , bindings_mt_ref_(LUA_NOREF)
+    , release_mutex_(enif_mutex_create(const_cast<char*>("moon.vm.release")))
+    , release_pending_(false)
+    , owner_(new owner_t(this))
+{
+	stack_guard_t guard(*this);
+
+    // lets budget_hook find its VM
+    lua_pushlightuserdata(luastate_.get(), this);
+    lua_setfield(luastate_.get(), LUA_REGISTRYINDEX, "moon_vm");
+
+    // the rest of the libraries are opened on demand (see lib_t)
+    open_core(luastate_.get(), luaopen_base, "");
+    open_core(luastate_.get(), luaopen_package, LUA_LOADLIBNAME);
+    open_core(luastate_.get(), luaopen_table, LUA_TABLIBNAME);
+    open_core(luastate_.get(), luaopen_string, LUA_STRLIBNAME);
+    open_core(luastate_.get(), luaopen_math, LUA_MATHLIBNAME);
+    open_core(luastate_.get(), luaopen_debug, LUA_DBLIBNAME);
+    open_core(luastate_.get(), luaopen_bit, LUA_BITLIBNAME);
+    open_core(luastate_.get(), luaopen_jit, LUA_JITLIBNAME); // also turns the JIT compiler on
+    if (options_.max_instructions || options_.max_cpu_time)
+    {
+        // the count hook never runs inside a compiled trace, so a hot loop
+        // would escape the budget; jit.on() must not bring the JIT back
+        luaJIT_setmode(luastate_.get(), 0, LUAJIT_MODE_ENGINE | LUAJIT_MODE_OFF);
+        lua_getglobal(luastate_.get(), LUA_JITLIBNAME);
+        lua_getfield(luastate_.get(), -1, "off");
+        lua_setfield(luastate_.get(), -2, "on");
+        lua_pop(luastate_.get(), 1);
+    }
+
+    // each library global starts as a placeholder that opens it on first
+    // use; _G itself keeps no metatable, so scripts may install their own
+    lua_getglobal(luastate_.get(), "package");
+    lua_getfield(luastate_.get(), -1, "preload");
+    for (lib_t const * lib = libs; lib->name; ++lib)
+    {
+        lua_pushcfunction(luastate_.get(), lib->open);
+        lua_setfield(luastate_.get(), -2, lib->name);
+        if (lib->global)
+        {
+            lua_newtable(luastate_.get());
+            lua_newtable(luastate_.get());
+            lua_pushstring(luastate_.get(), lib->name);
+            lua_pushstring(luastate_.get(), lib->global);
+            lua_pushcclosure(luastate_.get(), lazy_lib, 2);
+            lua_pushvalue(luastate_.get(), -1);
+            lua_setfield(luastate_.get(), -3, "__index");
+            lua_setfield(luastate_.get(), -2, "__newindex");
+            lua_setmetatable(luastate_.get(), -2);
+            lua_setfield(luastate_.get(), LUA_GLOBALSINDEX, lib->global);
+        }
+    }
+    lua_pop(luastate_.get(), 2);
+
+    for (std::size_t i = 0; i < options_.libs.size(); ++i)
+    {
+        lib_t const * lib = find_lib(options_.libs[i]);
+        if (lib) open_lib_now(luastate_.get(), lib);
+    }
+
+    lua_getglobal(luastate_.get(), "debug");
+    lua_getfield(luastate_.get(), -1, "traceback");
+    traceback_ref_ = luaL_ref(luastate_.get(), LUA_REGISTRYINDEX);
+    lua_pop(luastate_.get(), 1);
+
+    lua_newtable(luastate_.get());
+    lua_pushvalue(luastate_.get(), LUA_GLOBALSINDEX);
+    lua_setfield(luastate_.get(), -2, "__index");
+    lua_pushvalue(luastate_.get(), LUA_GLOBALSINDEX);
+    lua_setfield(luastate_.get(), -2, "__newindex");
+    bindings_mt_ref_ = luaL_ref(luastate_.get(), LUA_REGISTRYINDEX);
 
     //--add pid userdata metatable
     luaL_newmetatable(luastate_.get(), "pid_metatable");
@@ -296,6 +833,7 @@ vm_t::vm_t(erlcpp::lpid_t const& pid)
     lua_rawset(luastate_.get(), -3);
     lua_pop(luastate_.get(), 1);
     ////////////////////////////////////////////////////
+    lua::stack::open_buffer(luastate_.get());
 
 
 	lua_newtable(luastate_.get());
@@ -315,19 +853,23 @@ vm_t::vm_t(erlcpp::lpid_t const& pid)
 
 vm_t::~vm_t()
 {
+    enif_mutex_destroy(release_mutex_);
+    enif_mutex_destroy(resume_mutex_);
+    enif_mutex_destroy(internal_mutex_);
+    enif_mutex_destroy(exec_mutex_);
 //     enif_fprintf(stderr, "*** destruct the vm\n");
 }
 
 /////////////////////////////////////////////////////////////////////////////
 
-boost::shared_ptr<vm_t> vm_t::create(ErlNifResourceType* res_type, erlcpp::lpid_t const& pid)
+boost::shared_ptr<vm_t> vm_t::create(ErlNifResourceType* res_type, erlcpp::lpid_t const& pid, options_t const& options)
 {
-    enif_fprintf(stdout, "vm_t create------------------------------------------------------------------\n");
     void * buf = enif_alloc_resource(res_type, sizeof(vm_t));
     // TODO: may leak, need to guard agaist
-    boost::shared_ptr<vm_t> result(new (buf) vm_t(pid), enif_release_resource);
+    boost::shared_ptr<vm_t> result(new (buf) vm_t(pid, options), enif_release_resource);
 
-    if(enif_thread_create(NULL, &result->tid_, vm_t::thread_run, result.get(), NULL) != 0) {
+    // pooled VMs are picked up by a scheduler worker once they have work
+    if(!result->scheduler_ && enif_thread_create(NULL, &result->tid_, vm_t::thread_run, result.get(), NULL) != 0) {
         result.reset();
     }
 
@@ -336,8 +878,12 @@ boost::shared_ptr<vm_t> vm_t::create(ErlNifResourceType* res_type, erlcpp::lpid_
 
 void vm_t::destroy(ErlNifEnv* env, void* obj)
 {
-    static_cast<vm_t*>(obj)->stop();
-    static_cast<vm_t*>(obj)->~vm_t();
+    vm_t * vm = static_cast<vm_t*>(obj);
+    enif_mutex_lock(vm->owner_->mutex);
+    vm->owner_->vm = NULL; // prepared handles leave their slots to lua_close
+    enif_mutex_unlock(vm->owner_->mutex);
+    vm->stop();
+    vm->~vm_t();
 }
 
 void vm_t::run()
@@ -346,7 +892,10 @@ void vm_t::run()
     {
         for(;;)
         {
+            // sleep until something arrives, then drain the whole backlog
+            // in one pass before parking again
             perform_task<call_handler>(*this);
+            perform_ready_tasks<call_handler>(*this);
         }
     }
     catch(quit_tag) {}
@@ -357,30 +906,449 @@ void vm_t::run()
     catch(...) {}
 }
 
+void vm_t::run_slice()
+{
+    // bound the slice so a busy VM cannot monopolise its worker
+    static const std::size_t slice = 64;
+    try
+    {
+        perform_ready_tasks<call_handler>(*this, slice);
+    }
+    catch(quit_tag) {}
+    catch(std::exception & ex)
+    {
+        enif_fprintf(stderr, "*** exception in vm slice: %s\n", ex.what());
+    }
+    catch(...) {}
+
+    scheduled_.store(false);
+    if (queue_len() && !scheduled_.exchange(true))
+    {
+        // still runnable: keep the reference taken in schedule()
+        scheduler_->schedule(this);
+        return;
+    }
+    enif_release_resource(this);
+}
+
 void vm_t::stop()
 {
-    queue_.push(tasks::quit_t());
+    // a pooled VM is only destroyed once no worker holds a reference
+    if (scheduler_) return;
+
+    enqueue(tasks::quit_t());
     enif_thread_join(tid_, NULL);
 };
 
-void vm_t::add_task(task_t const& task)
+void vm_t::schedule()
+{
+    if (scheduler_ && !scheduled_.exchange(true))
+    {
+        // the worker owns this reference until the slice is done
+        enif_keep_resource(this);
+        scheduler_->schedule(this);
+    }
+}
+
+bool vm_t::add_task(task_t const& task, flow_key_t const& flow, unsigned weight)
+{
+    // tasks parked in the flows still count against the capacity; the ring
+    // itself is rounded up to a power of two, never smaller than that
+    if (parked_.load(boost::memory_order_relaxed) + queue_.size() >= options_.queue_size
+        || !queue_.try_push(queued_t(task, flow, weight)))
+    {
+        overloaded_.fetch_add(1, boost::memory_order_relaxed);
+        return false;
+    }
+
+    std::size_t depth = queue_len();
+    std::size_t high = high_water_.load(boost::memory_order_relaxed);
+    while(depth > high && !high_water_.compare_exchange_weak(high, depth, boost::memory_order_relaxed));
+
+    schedule();
+    return true;
+}
+
+void vm_t::enqueue(task_t const& task)
+{
+    enif_mutex_lock(internal_mutex_);
+    internal_.push_back(task);
+    internal_size_.fetch_add(1);
+    enif_mutex_unlock(internal_mutex_);
+    queue_.notify();
+    schedule();
+}
+
+boost::optional<vm_t::task_t> vm_t::take_internal()
+{
+    boost::optional<task_t> result;
+    if (!internal_size_.load(boost::memory_order_relaxed)) return result;
+
+    enif_mutex_lock(internal_mutex_);
+    if (!internal_.empty())
+    {
+        result = internal_.front();
+        internal_.pop_front();
+        internal_size_.fetch_sub(1);
+    }
+    enif_mutex_unlock(internal_mutex_);
+    return result;
+}
+
+vm_t::stats_t vm_t::stats() const
 {
-    queue_.push(task);
+    stats_t result;
+    result.queue_len  = queue_len();
+    result.capacity   = options_.queue_size;
+    result.high_water = high_water_.load(boost::memory_order_relaxed);
+    result.overloaded = overloaded_.load(boost::memory_order_relaxed);
+    result.expired    = expired_.load(boost::memory_order_relaxed);
+    result.busy_time  = busy_time_.load(boost::memory_order_relaxed);
+    result.tasks      = tasks_.load(boost::memory_order_relaxed);
+    result.running    = running_.load();
+    result.suspended  = suspended_count_.load();
+    return result;
+}
+
+bool vm_t::expired(uint64_t deadline, ERL_NIF_TERM ref)
+{
+    if ((!deadline || monotonic_time() < deadline) && !cancelled(ref)) return false;
+    expired_.fetch_add(1, boost::memory_order_relaxed);
+    return true;
 }
 
 vm_t::task_t vm_t::get_task()
 {
-    return queue_.pop();
+    for(;;)
+    {
+        if (boost::optional<task_t> task = try_get_task()) return *task;
+        queue_.wait(internal_ready_t(*this));
+    }
+}
+
+boost::optional<vm_t::task_t> vm_t::try_get_task()
+{
+    // counted as running before it leaves the queue, so a task is never
+    // in neither count; task_done takes it off again
+    running_.fetch_add(1);
+    boost::optional<task_t> task = next_task();
+    if (!task) running_.fetch_sub(1);
+    return task;
+}
+
+boost::optional<vm_t::task_t> vm_t::next_task()
+{
+    if (boost::optional<task_t> task = take_internal()) return task;
+
+    if (!options_.fair_queuing)
+    {
+        boost::optional<queued_t> queued = queue_.try_pop();
+        return queued ? boost::optional<task_t>(queued->task) : boost::optional<task_t>();
+    }
+
+    drain();
+    return next_fair();
+}
+
+void vm_t::task_done()
+{
+    running_.fetch_sub(1);
+
+    if (release_pending_.exchange(false))
+    {
+        std::vector<int> refs;
+        enif_mutex_lock(release_mutex_);
+        refs.swap(released_);
+        enif_mutex_unlock(release_mutex_);
+        for(std::size_t i = 0; i < refs.size(); ++i)
+        {
+            luaL_unref(state(), LUA_REGISTRYINDEX, refs[i]);
+        }
+    }
+
+    if (!serving_) return;
+
+    std::map<flow_key_t, flow_t>::iterator i = flows_.find(*serving_);
+    if (i != flows_.end())
+    {
+        i->second.deficit -= static_cast<int64_t>(monotonic_time() - serving_since_);
+    }
+    serving_ = boost::none;
+}
+
+// Moves everything that has arrived into the per-flow queues.
+void vm_t::drain()
+{
+    while(boost::optional<queued_t> queued = queue_.try_pop())
+    {
+        parked_.fetch_add(1, boost::memory_order_relaxed);
+        std::map<flow_key_t, flow_t>::iterator i = flows_.find(queued->flow);
+        if (i == flows_.end())
+        {
+            // a flow is in flows_ exactly as long as it is in the round;
+            // its weight is the one it started with
+            i = flows_.insert(std::make_pair(queued->flow, flow_t())).first;
+            i->second.weight = queued->weight;
+            active_.push_back(queued->flow);
+        }
+        i->second.tasks.push_back(queued->task);
+    }
+}
+
+// Deficit round-robin: the flow at the head of active_ keeps being served
+// while it has credit left; once its charged execution time uses the credit
+// up it gets another quantum (scaled by its weight) and goes to the back.
+boost::optional<vm_t::task_t> vm_t::next_fair()
+{
+    static const int64_t quantum = 1000; // microseconds
+
+    boost::optional<task_t> result;
+    while(!active_.empty())
+    {
+        flow_key_t key = active_.front();
+        flow_t & flow = flows_[key];
+        if (flow.tasks.empty())
+        {
+            // idle flows do not keep credit (nor debt) around
+            active_.pop_front();
+            flows_.erase(key);
+        }
+        else if (flow.deficit <= 0)
+        {
+            flow.deficit += quantum * flow.weight;
+            active_.pop_front();
+            active_.push_back(key);
+        }
+        else
+        {
+            result = flow.tasks.front();
+            flow.tasks.pop_front();
+            parked_.fetch_sub(1, boost::memory_order_relaxed);
+            serving_ = key;
+            serving_since_ = monotonic_time();
+            break;
+        }
+    }
+    return result;
 }
 
 void vm_t::add_resp_task(task_t const& task)
 {
-    resp_queue_.push(task);
+    tasks::resp_t const& resp = boost::get<tasks::resp_t>(task);
+
+    enif_mutex_lock(resume_mutex_);
+    bool resume = resumes_.erase(resp.id) != 0;
+    enif_mutex_unlock(resume_mutex_);
+
+    if (resume) {
+        enqueue(task);
+    } else if (resp.id == awaited_.load()) {
+        resp_queue_.push(task);
+    }
+    // anything else answers a request that is gone (or never existed)
+}
+
+void vm_t::expect_resume(uint64_t id)
+{
+    enif_mutex_lock(resume_mutex_);
+    resumes_.insert(id);
+    enif_mutex_unlock(resume_mutex_);
+}
+
+void vm_t::expect_response(uint64_t id)
+{
+    awaited_.store(id);
+}
+
+void vm_t::cancel_request(uint64_t id)
+{
+    enif_mutex_lock(resume_mutex_);
+    resumes_.erase(id);
+    enif_mutex_unlock(resume_mutex_);
+
+    uint64_t expected = id;
+    awaited_.compare_exchange_strong(expected, 0);
+}
+
+void vm_t::suspend(uint64_t id, coroutine_t const& co)
+{
+    suspended_[id] = co;
+    suspended_count_.store(suspended_.size());
+}
+
+boost::optional<vm_t::coroutine_t> vm_t::take_suspended(uint64_t id)
+{
+    boost::optional<coroutine_t> result;
+    std::map<uint64_t, coroutine_t>::iterator i = suspended_.find(id);
+    if (i != suspended_.end())
+    {
+        result = i->second;
+        suspended_.erase(i);
+        suspended_count_.store(suspended_.size());
+    }
+    return result;
+}
+
+void vm_t::cancel(tasks::cancel_t const& cancel)
+{
+    cancelled_.push_back(std::make_pair(monotonic_time(), cancel));
+
+    std::map<uint64_t, coroutine_t>::iterator i = suspended_.begin();
+    while (i != suspended_.end())
+    {
+        if (i->second.reply && enif_is_identical(i->second.reply, cancel.ref))
+        {
+            cancel_request(i->first);
+            luaL_unref(state(), LUA_REGISTRYINDEX, i->second.ref);
+            suspended_.erase(i++);
+        }
+        else
+        {
+            ++i;
+        }
+    }
+    suspended_count_.store(suspended_.size());
+}
+
+bool vm_t::cancelled(ERL_NIF_TERM ref)
+{
+    // A request only times out once its deadline has passed, and the task
+    // got that same deadline: a second later the task has either run or
+    // is dropped as expired when it comes up, so the ref can be forgotten.
+    static const uint64_t keep = 1000000;
+    uint64_t now = monotonic_time();
+    while (!cancelled_.empty() && cancelled_.front().first + keep < now)
+    {
+        cancelled_.pop_front();
+    }
+
+    if (!ref) return false;
+    for (std::size_t i = 0; i < cancelled_.size(); ++i)
+    {
+        if (enif_is_identical(cancelled_[i].second.ref, ref)) return true;
+    }
+    return false;
+}
+
+// Blocks until the reply to request id arrives, discarding any other
+// reply that slipped into the response queue.
+vm_t::task_t vm_t::get_resp_task(uint64_t id)
+{
+    for(;;)
+    {
+        task_t task = resp_queue_.pop();
+        if (boost::get<tasks::resp_t>(task).id == id)
+        {
+            cancel_request(id);
+            return task;
+        }
+    }
+}
+
+uint64_t monotonic_time()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return static_cast<uint64_t>(ts.tv_sec) * 1000000 + ts.tv_nsec / 1000;
+}
+
+static uint64_t thread_cpu_time()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return static_cast<uint64_t>(ts.tv_sec) * 1000000 + ts.tv_nsec / 1000;
 }
 
-vm_t::task_t vm_t::get_resp_task()
+void vm_t::arm_budget(lua_State * L, coroutine_t const* co)
 {
-    return resp_queue_.pop_resp();
+    budget_ = budget_t();
+    if (!options_.max_instructions && !options_.max_cpu_time) return;
+    if (co) budget_.instructions = co->instructions;
+
+    // the hook runs every `interval` VM instructions (interpreted code only);
+    // checking the clock every 10k instructions keeps the overhead low
+    static const uint64_t interval = 10000;
+    budget_.interval = static_cast<int>(
+        (options_.max_instructions && options_.max_instructions < interval) ? options_.max_instructions : interval);
+    // a resumed coroutine may be on another thread (pooled): only the
+    // CPU time spent so far is carried over, not the clock reading
+    if (options_.max_cpu_time) budget_.cpu_start = thread_cpu_time() - (co ? co->cpu_time : 0);
+    lua_sethook(L, vm_t::budget_hook, LUA_MASKCOUNT, budget_.interval);
+}
+
+void vm_t::disarm_budget(lua_State * L, coroutine_t * co)
+{
+    if (!budget_.interval) return;
+    lua_sethook(L, NULL, 0, 0);
+    if (co)
+    {
+        co->instructions = budget_.instructions;
+        co->cpu_time = options_.max_cpu_time ? thread_cpu_time() - budget_.cpu_start : 0;
+    }
+}
+
+bool vm_t::check_budget()
+{
+    if (budget_.interval && !budget_.exceeded && options_.max_cpu_time)
+    {
+        budget_.exceeded = thread_cpu_time() - budget_.cpu_start >= options_.max_cpu_time;
+    }
+    return budget_.exceeded;
+}
+
+void vm_t::budget_hook(lua_State * L, lua_Debug * ar)
+{
+    lua_getfield(L, LUA_REGISTRYINDEX, "moon_vm");
+    vm_t * vm = static_cast<vm_t*>(lua_touserdata(L, -1));
+    lua_pop(L, 1);
+
+    budget_t & budget = vm->budget_;
+    budget.instructions += budget.interval;
+    if (!budget.exceeded)
+    {
+        budget.exceeded =
+            (vm->options_.max_instructions && budget.instructions >= vm->options_.max_instructions) ||
+            (vm->options_.max_cpu_time && thread_cpu_time() - budget.cpu_start >= vm->options_.max_cpu_time);
+    }
+
+    // keeps firing, so a pcall inside the script cannot swallow the abort
+    if (budget.exceeded)
+    {
+        lua_pushliteral(L, "timeout");
+        lua_error(L);
+    }
+}
+
+ERL_NIF_TERM vm_t::call_sync(tasks::call_t const& call, ErlNifEnv * env)
+{
+    // running from the moment it waits for the VM, as a queued task would be
+    running_.fetch_add(1);
+    try
+    {
+        exec_lock_t lock(*this);
+        cur_caller = call.caller;
+        ERL_NIF_TERM result = call_function(*this, call, env);
+        running_.fetch_sub(1);
+        return result;
+    }
+    catch(...)
+    {
+        running_.fetch_sub(1);
+        throw;
+    }
+}
+
+void vm_t::lock()
+{
+    enif_mutex_lock(exec_mutex_);
+    locked_since_ = monotonic_time();
+}
+
+void vm_t::unlock()
+{
+    busy_time_.fetch_add(monotonic_time() - locked_since_, boost::memory_order_relaxed);
+    tasks_.fetch_add(1, boost::memory_order_relaxed);
+    enif_mutex_unlock(exec_mutex_);
 }
 
 lua_State* vm_t::state()
@@ -393,6 +1361,112 @@ lua_State const* vm_t::state() const
     return luastate_.get();
 }
 
+ErlNifResourceType * vm_t::prepared_t::resource_type = NULL;
+
+void vm_t::prepared_t::destroy(ErlNifEnv* env, void* obj)
+{
+    prepared_t * prepared = static_cast<prepared_t*>(obj);
+    enif_mutex_lock(prepared->owner->mutex);
+    if (prepared->owner->vm)
+    {
+        prepared->owner->vm->release_ref(prepared->ref);
+    }
+    enif_mutex_unlock(prepared->owner->mutex);
+    prepared->~prepared_t();
+}
+
+vm_t::prepared_t * vm_t::prepare(std::string const& path)
+{
+    exec_lock_t lock(*this);
+    stack_guard_t guard(*this);
+    lua_State * L = state();
+
+    // a library global is only a placeholder until the library is opened
+    lib_t const * lib = find_lib(path.substr(0, path.find('.')));
+    if (lib && lib->global && path.compare(0, path.find('.'), lib->global) == 0)
+    {
+        open_lib_now(L, lib);
+    }
+
+    // plain tables only, read raw: nothing here may raise a Lua error
+    lua_pushvalue(L, LUA_GLOBALSINDEX);
+    std::string::size_type begin = 0, end;
+    do
+    {
+        if (!lua_istable(L, -1)) {
+            return NULL;
+        }
+        end = path.find('.', begin);
+        std::string name = path.substr(begin, end == std::string::npos ? end : end - begin);
+        lua_pushlstring(L, name.data(), name.size());
+        lua_rawget(L, -2);
+        lua_remove(L, -2);
+        begin = end + 1;
+    }
+    while(end != std::string::npos);
+
+    if (!lua_isfunction(L, -1)) {
+        return NULL;
+    }
+
+    prepared_t * prepared = new (enif_alloc_resource(prepared_t::resource_type, sizeof(prepared_t))) prepared_t();
+    prepared->owner = owner_;
+    prepared->ref = luaL_ref(L, LUA_REGISTRYINDEX);
+    return prepared;
+}
+
+boost::shared_ptr<vm_t::prepared_t> vm_t::get_prepared(ErlNifEnv * env, ERL_NIF_TERM term)
+{
+    prepared_t * prepared = NULL;
+    if (!enif_get_resource(env, term, prepared_t::resource_type, reinterpret_cast<void**>(&prepared))
+        || prepared->owner != owner_)
+    {
+        return boost::shared_ptr<prepared_t>();
+    }
+    enif_keep_resource(prepared);
+    return boost::shared_ptr<prepared_t>(prepared, enif_release_resource);
+}
+
+void vm_t::release_ref(int ref)
+{
+    // not lock(): this is no task
+    if (enif_mutex_trylock(exec_mutex_) == 0)
+    {
+        luaL_unref(state(), LUA_REGISTRYINDEX, ref);
+        enif_mutex_unlock(exec_mutex_);
+        return;
+    }
+    enif_mutex_lock(release_mutex_);
+    released_.push_back(ref);
+    enif_mutex_unlock(release_mutex_);
+    release_pending_.store(true);
+}
+
+// Bounds the intern table; further atoms are pushed as fresh strings.
+static const std::size_t MAX_INTERNED_ATOMS = 4096;
+
+void vm_t::push_atom(lua_State * L, ErlNifEnv * env, ERL_NIF_TERM atom)
+{
+    boost::unordered_map<ERL_NIF_TERM, int>::const_iterator i = interned_.find(atom);
+    if (i != interned_.end())
+    {
+        lua_rawgeti(L, LUA_REGISTRYINDEX, i->second);
+        return;
+    }
+
+    char name[256];
+    int len = enif_get_atom(env, atom, name, sizeof(name), ERL_NIF_LATIN1);
+    if (len <= 0) {
+        throw errors::invalid_type("invalid_atom");
+    }
+    lua_pushlstring(L, name, len - 1);
+    if (interned_.size() < MAX_INTERNED_ATOMS)
+    {
+        lua_pushvalue(L, -1);
+        interned_[atom] = luaL_ref(L, LUA_REGISTRYINDEX);
+    }
+}
+
 void* vm_t::thread_run(void * vm)
 {
     static_cast<vm_t*>(vm)->run();
@@ -2,56 +2,197 @@
 
 #include "types.hpp"
 #include "queue.hpp"
+#include "scheduler.hpp"
 
+#include <map>
+#include <set>
+#include <deque>
+#include <string>
+#include <vector>
 #include <lua.hpp>
+#include <boost/atomic.hpp>
 #include <boost/shared_ptr.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/unordered_map.hpp>
 
 namespace lua {
 
+// CLOCK_MONOTONIC in microseconds; the clock of task deadlines.
+uint64_t monotonic_time();
+
 class vm_t
 {
+public :
+    struct options_t
+    {
+        options_t()
+            : scheduler(NULL), max_instructions(0), max_cpu_time(0), queue_size(1024), fair_queuing(false)
+            , buffer_threshold(0), return_maps(false)
+        {}
+        // when set, the VM is a runnable unit of this worker pool instead
+        // of owning a dedicated OS thread; a blocking erlang.call (see
+        // erlang_call) keeps its worker for as long as it waits
+        scheduler_t * scheduler;
+        // per-call budgets (0 = unlimited); a call exceeding either one is
+        // aborted with {error_lua, timeout}. Setting one turns the JIT off:
+        // compiled traces never reach the count hook
+        uint64_t      max_instructions;
+        uint64_t      max_cpu_time; // microseconds of VM thread CPU time
+        // pending tasks accepted before load/eval/call answer overloaded
+        std::size_t   queue_size;
+        // serve callers/tenants by deficit round-robin over their measured
+        // execution time instead of in arrival order
+        bool          fair_queuing;
+        // binaries of at least this many bytes reach Lua as moon.buffer
+        // userdata sharing the Erlang binary (0 = always as strings)
+        std::size_t   buffer_threshold;
+        // Lua hash tables come back as maps instead of {Key, Value} lists
+        bool          return_maps;
+        // on-demand libraries (cjson, os, ...) to open with the VM instead
+        // of on first use
+        std::vector<std::string> libs;
+    };
+
+    // Snapshot of the queue counters, for load balancers.
+    struct stats_t
+    {
+        std::size_t queue_len;
+        std::size_t capacity;
+        std::size_t high_water; // deepest the queue has been
+        uint64_t    overloaded; // tasks rejected because the queue was full
+        uint64_t    expired;    // tasks dropped because their deadline passed
+        uint64_t    busy_time;  // microseconds the VM was held running tasks
+        uint64_t    tasks;      // tasks run (including call_sync and prepare)
+        std::size_t running;    // tasks taken off the queue and not finished yet
+        std::size_t suspended;  // coroutines waiting for an erlang.call reply
+    };
+
 private:
-    vm_t(erlcpp::lpid_t const& pid);
+    vm_t(erlcpp::lpid_t const& pid, options_t const& options);
     ~vm_t();
 
     void run();
     void stop();
+    void schedule();
 
     static void* thread_run(void * vm);
+    static void budget_hook(lua_State * L, lua_Debug * ar);
+
+    struct budget_t
+    {
+        budget_t() : interval(0), instructions(0), cpu_start(0), exceeded(false) {}
+        int      interval;
+        uint64_t instructions;
+        uint64_t cpu_start; // thread CPU time, less what was spent before
+        bool     exceeded;
+    };
 
 public :
+    // Shared by a VM and its prepared handles; vm is cleared, under mutex,
+    // as soon as the VM is being destroyed.
+    struct owner_t : boost::noncopyable
+    {
+        explicit owner_t(vm_t * vm)
+            : mutex(enif_mutex_create(const_cast<char*>("moon.vm.owner"))), vm(vm)
+        {}
+        ~owner_t() { enif_mutex_destroy(mutex); }
+        ErlNifMutex * mutex;
+        vm_t *        vm;
+    };
+
+    // A function resolved once by moon:prepare and held by a NIF resource;
+    // calls through it skip the name lookup. The handle does not keep its
+    // VM alive: it could be dropped last on the VM thread, which cannot
+    // destroy its own VM. The VM frees the slot, or takes it along.
+    struct prepared_t
+    {
+        static ErlNifResourceType * resource_type;
+        static void destroy(ErlNifEnv* env, void* obj);
+
+        boost::shared_ptr<owner_t> owner;
+        int                        ref; // registry slot of the function
+    };
+
+    // Tasks carry an absolute deadline on the monotonic_time() clock
+    // (0 = none); one that is still queued past it is dropped unrun.
+    // Their moon_response is tagged with ref, a term of the task's env
+    // (0 = tagged with the caller pid).
     struct tasks
     {
         struct load_t
         {
-            load_t(erlcpp::binary_t const& file, erlcpp::lpid_t const& caller)
-                : file(file), caller(caller)
+            load_t(boost::shared_ptr<ErlNifEnv> const& env, ERL_NIF_TERM file, erlcpp::lpid_t const& caller, uint64_t deadline = 0,
+                   ERL_NIF_TERM ref = 0)
+                : env(env), file(file), caller(caller), deadline(deadline), ref(ref)
             {}
-            erlcpp::binary_t file;
+            boost::shared_ptr<ErlNifEnv> env; // holds file and ref
+            ERL_NIF_TERM     file;
 			erlcpp::lpid_t	 caller;
+            uint64_t         deadline;
+            ERL_NIF_TERM     ref;
         };
         struct eval_t
         {
-            eval_t(erlcpp::binary_t const& code, erlcpp::lpid_t const& caller)
-                : code(code), caller(caller)
+            eval_t(boost::shared_ptr<ErlNifEnv> const& env, ERL_NIF_TERM code, erlcpp::lpid_t const& caller, uint64_t deadline = 0,
+                   ERL_NIF_TERM bindings = 0, ERL_NIF_TERM ref = 0)
+                : env(env), code(code), bindings(bindings), caller(caller), deadline(deadline), ref(ref)
             {}
-            erlcpp::binary_t code;
+            boost::shared_ptr<ErlNifEnv> env; // holds code, read in place by the VM thread
+            ERL_NIF_TERM     code;
+            ERL_NIF_TERM     bindings; // map of names visible to the chunk (0 = none)
 			erlcpp::lpid_t	 caller;
+            uint64_t         deadline;
+            ERL_NIF_TERM     ref;
         };
         struct call_t
         {
-            call_t(erlcpp::atom_t const& fun, erlcpp::list_t const& args, erlcpp::lpid_t const& caller)
-                : fun(fun), args(args), caller(caller)
+            call_t(erlcpp::atom_t const& fun, boost::shared_ptr<ErlNifEnv> const& env, ERL_NIF_TERM args,
+                   erlcpp::lpid_t const& caller, uint64_t deadline = 0)
+                : fun(fun), env(env), args(args), caller(caller), deadline(deadline), ref(0), async(false)
+            {};
+            call_t(boost::shared_ptr<prepared_t> const& prepared, boost::shared_ptr<ErlNifEnv> const& env,
+                   ERL_NIF_TERM args, erlcpp::lpid_t const& caller, uint64_t deadline = 0)
+                : prepared(prepared), env(env), args(args), caller(caller), deadline(deadline), ref(0), async(false)
             {};
             erlcpp::atom_t fun;
-            erlcpp::list_t args;
+            boost::shared_ptr<prepared_t> prepared; // used instead of fun when set
+            boost::shared_ptr<ErlNifEnv> env; // holds args, pushed straight onto the Lua stack
+            ERL_NIF_TERM   args;
 			erlcpp::lpid_t caller;
+            uint64_t       deadline;
+            ERL_NIF_TERM   ref;
+            bool           async; // from call_async: callbacks go to the VM owner
+        };
+        struct call_batch_t
+        {
+            call_batch_t(boost::shared_ptr<ErlNifEnv> const& env, ERL_NIF_TERM calls,
+                         erlcpp::lpid_t const& caller, uint64_t deadline = 0, ERL_NIF_TERM ref = 0)
+                : env(env), calls(calls), caller(caller), deadline(deadline), ref(ref)
+            {};
+            boost::shared_ptr<ErlNifEnv> env; // holds calls, a list of {Fun, Args}
+            ERL_NIF_TERM        calls;
+            erlcpp::lpid_t      caller;
+            uint64_t            deadline;
+            ERL_NIF_TERM        ref;
         };
         struct resp_t
         {
-            resp_t(erlcpp::term_t const& term, erlcpp::lpid_t const& caller) : term(term), caller(caller) {}
-            erlcpp::term_t term;
+            resp_t(boost::shared_ptr<ErlNifEnv> const& env, ERL_NIF_TERM term, erlcpp::lpid_t const& caller, uint64_t id)
+                : env(env), term(term), caller(caller), id(id)
+            {}
+            boost::shared_ptr<ErlNifEnv> env; // holds term
+            ERL_NIF_TERM   term;
 			erlcpp::lpid_t caller;
+            uint64_t       id; // request id of the moon_callback being answered
+        };
+        // The caller of the task tagged ref gave up on it (timed out).
+        struct cancel_t
+        {
+            cancel_t(boost::shared_ptr<ErlNifEnv> const& env, ERL_NIF_TERM ref)
+                : env(env), ref(ref)
+            {}
+            boost::shared_ptr<ErlNifEnv> env; // holds ref
+            ERL_NIF_TERM   ref;
         };
         struct quit_t {};
     };
@@ -60,7 +201,9 @@ public :
         tasks::load_t,
         tasks::eval_t,
         tasks::call_t,
+        tasks::call_batch_t,
         tasks::resp_t,
+        tasks::cancel_t,
         tasks::quit_t
     > task_t;
 
@@ -68,26 +211,207 @@ public :
 
     erlcpp::lpid_t erl_pid() const { return pid_; }
 
-    void add_task(task_t const& task);
+    // Identifies a fair queuing flow: the external format of the tenant
+    // term, compared whole so that two tenants never share a flow.
+    typedef std::string flow_key_t;
+    bool fair_queuing() const { return options_.fair_queuing; }
+
+    // Returns false (and counts it) when options_t::queue_size tasks are
+    // pending already. flow identifies the caller or tenant for fair
+    // queuing; weight scales its share, as given by the task that starts
+    // the flow (it stays until the flow runs out of tasks).
+    bool add_task(task_t const& task, flow_key_t const& flow = flow_key_t(), unsigned weight = 1);
+    // Internal tasks (callback replies, quit) go to a queue of their own,
+    // unbounded: they never wait for room, even in a NIF, and are served
+    // ahead of the others.
+    void enqueue(task_t const& task);
     task_t get_task();
+    boost::optional<task_t> try_get_task();
+    // Charges the execution time of the task just taken to its flow.
+    void task_done();
 
+    // Every moon_callback carries a fresh request id and moon_nif:result
+    // hands it back; replies nobody is waiting for are dropped.
+    uint64_t new_request() { return next_request_.fetch_add(1) + 1; }
     void add_resp_task(task_t const& task);
-    task_t get_resp_task();
+    task_t get_resp_task(uint64_t id);
 
 
+    // Runs call on the calling thread, waiting for the VM to be free
+    // (used from the dirty scheduler by moon_nif:call_sync); the result is
+    // encoded in env.
+    ERL_NIF_TERM call_sync(tasks::call_t const& call, ErlNifEnv * env);
+
+    // Resolves a dotted path (mod.sub.fn) from the globals on the calling
+    // thread, while holding the VM; NULL unless it names a function. The
+    // caller owns the returned resource reference.
+    prepared_t * prepare(std::string const& path);
+    // The handle of this VM that term refers to, if any.
+    boost::shared_ptr<prepared_t> get_prepared(ErlNifEnv * env, ERL_NIF_TERM term);
+    // Frees a registry slot from any thread: right away when the VM is
+    // idle, otherwise by the VM thread after its current task.
+    void release_ref(int ref);
+
+    // debug.traceback, looked up once.
+    int traceback_ref() const { return traceback_ref_; }
+    // Metatable of the environment of an eval with bindings: other names
+    // are read from and assigned to the globals.
+    int bindings_mt_ref() const { return bindings_mt_ref_; }
+
+    // The VM is held while a task runs so that call_sync never shares the
+    // lua_State with the VM thread or a pool worker.
+    void lock();
+    void unlock();
+
+    // Each call/eval runs in a coroutine of its own. One that yields in
+    // erlang.call is parked until moon_nif:result delivers its reply, and
+    // the VM goes on with other tasks in the meantime.
+    struct coroutine_t
+    {
+        int            ref;       // registry anchor of thread
+        lua_State *    thread;
+        erlcpp::lpid_t caller;
+        boost::shared_ptr<ErlNifEnv> env; // the task's, holds reply
+        ERL_NIF_TERM   reply;     // ref of the task (0 = none)
+        bool           traceback; // report errors with a stack traceback
+        bool           async;     // the caller may not be waiting (call_async)
+        uint64_t       instructions; // budget spent by earlier resumes
+        uint64_t       cpu_time;
+    };
+
+    // Arms/disarms the instruction and CPU budget for the next Lua call on
+    // thread L; budget_exceeded() tells whether that call was aborted. A
+    // coroutine resumes with what it has spent so far and keeps the rest.
+    void arm_budget(lua_State * L, coroutine_t const* co = NULL);
+    void disarm_budget(lua_State * L, coroutine_t * co = NULL);
+    bool budget_exceeded() const { return budget_.exceeded; }
+    // Checks the CPU budget outside the count hook (from erlang.call, which
+    // may come back too often for the hook to ever fire); true when spent.
+    bool check_budget();
+
+    // The coroutine being resumed, if any (erlang.call may only yield from it).
+    lua_State * task_thread() const { return task_thread_; }
+    void set_task_thread(lua_State * thread) { task_thread_ = thread; }
+
+    void suspend(uint64_t id, coroutine_t const& co);
+    boost::optional<coroutine_t> take_suspended(uint64_t id);
+    // The caller of the task tagged cancel.ref gave up: its coroutines that
+    // wait for a callback are dropped, and the ref is remembered so that
+    // the task is not started, nor parked again, from now on.
+    void cancel(tasks::cancel_t const& cancel);
+    bool cancelled(ERL_NIF_TERM ref);
+
+    // Routes the reply to request id to the task queue (to resume its
+    // coroutine), or to the response queue for a blocking erlang.call.
+    void expect_resume(uint64_t id);
+    void expect_response(uint64_t id);
+    void cancel_request(uint64_t id);
+
+    std::size_t queue_len() const
+    {
+        return queue_.size() + parked_.load(boost::memory_order_relaxed)
+             + internal_size_.load(boost::memory_order_relaxed);
+    }
+    // True (and counted) when a task with this deadline (and ref) should
+    // be skipped.
+    bool expired(uint64_t deadline, ERL_NIF_TERM ref = 0);
+    stats_t stats() const;
+
     lua_State* state();
     lua_State const * state() const;
+    std::size_t buffer_threshold() const { return options_.buffer_threshold; }
+    bool return_maps() const { return options_.return_maps; }
+
+    // Pushes the name of atom (a term of any env) onto L. The Lua string
+    // is kept in the registry the first time the VM sees the atom, so
+    // repeated atoms (record-like keys, tags) are pushed without a copy.
+    void push_atom(lua_State * L, ErlNifEnv * env, ERL_NIF_TERM atom);
 
     static void destroy(ErlNifEnv* env, void* obj);
-    static boost::shared_ptr<vm_t> create(ErlNifResourceType* res_type, erlcpp::lpid_t const& pid);
-    
+    // Whether name is a library that can be listed in options_t::libs.
+    static bool known_lib(std::string const& name);
+    static boost::shared_ptr<vm_t> create(ErlNifResourceType* res_type, erlcpp::lpid_t const& pid, options_t const& options);
+
+    // Pooled mode: runs a bounded slice of the queued tasks on the calling
+    // worker, then hands the VM back to the scheduler if work remains.
+    void run_slice();
+
     erlcpp::lpid_t               cur_caller;
+    ERL_NIF_TERM                 cur_ref;       // of the coroutine being resumed
+    bool                         cur_async;     // likewise
+    uint64_t                     yield_request; // set by erlang.call before it yields
 private :
+    struct queued_t
+    {
+        queued_t(task_t const& task, flow_key_t const& flow = flow_key_t(), unsigned weight = 1)
+            : task(task), flow(flow), weight(weight)
+        {}
+        task_t     task;
+        flow_key_t flow;
+        unsigned   weight;
+    };
+
+    struct flow_t
+    {
+        flow_t() : deficit(0), weight(1) {}
+        std::deque<task_t> tasks;
+        int64_t            deficit; // microseconds of execution still owed
+        unsigned           weight;
+    };
+
+    struct internal_ready_t
+    {
+        internal_ready_t(vm_t const& vm) : vm(vm) {}
+        bool operator()() const { return vm.internal_size_.load(boost::memory_order_relaxed) != 0; }
+        vm_t const& vm;
+    };
+
+    boost::optional<task_t> take_internal();
+    boost::optional<task_t> next_task();
+    void drain();
+    boost::optional<task_t> next_fair();
+
     erlcpp::lpid_t               pid_;
     ErlNifTid                    tid_;
+    ErlNifMutex *                exec_mutex_;
+    options_t                    options_;
+    budget_t                     budget_;
+    scheduler_t *                scheduler_;
+    boost::atomic<bool>          scheduled_;
     boost::shared_ptr<lua_State> luastate_;
-    queue<task_t>                queue_;
+    queue<queued_t>              queue_;
+    ErlNifMutex *                internal_mutex_;
+    std::deque<task_t>           internal_;
+    boost::atomic<std::size_t>   internal_size_;
+    // fair queuing state, only touched by the thread running the tasks
+    std::map<flow_key_t, flow_t> flows_;
+    std::deque<flow_key_t>       active_;
+    boost::optional<flow_key_t>  serving_;
+    uint64_t                     serving_since_;
+    boost::atomic<std::size_t>   parked_; // tasks moved out of queue_
+    boost::atomic<std::size_t>   high_water_;
+    boost::atomic<uint64_t>      overloaded_;
+    boost::atomic<uint64_t>      expired_;
+    boost::atomic<uint64_t>      busy_time_;
+    boost::atomic<uint64_t>      tasks_;
+    boost::atomic<std::size_t>   running_;
+    uint64_t                     locked_since_; // guarded by exec_mutex_
     queue<task_t>                resp_queue_;
+    lua_State *                  task_thread_;
+    boost::atomic<uint64_t>      next_request_;
+    std::map<uint64_t, coroutine_t> suspended_;
+    std::deque<std::pair<uint64_t, tasks::cancel_t> > cancelled_; // by time of the cancel
+    boost::atomic<std::size_t>   suspended_count_; // suspended_.size(), for stats
+    ErlNifMutex *                resume_mutex_;
+    std::set<uint64_t>           resumes_;
+    boost::atomic<uint64_t>      awaited_; // request of the blocking erlang.call
+    boost::unordered_map<ERL_NIF_TERM, int> interned_; // atom -> registry ref
+    int                          traceback_ref_;
+    int                          bindings_mt_ref_;
+    ErlNifMutex *                release_mutex_;
+    std::vector<int>             released_;
+    boost::atomic<bool>          release_pending_;
+    boost::shared_ptr<owner_t>   owner_;
 };
 
 }
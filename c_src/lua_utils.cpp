@@ -1,15 +1,186 @@
 #include "errors.hpp"
 #include "lua_utils.hpp"
+#include "moon_buffer.h"
 
 #include "erl_nif.h"
 
 const int MAX_DEPTH = 20;
 
 namespace lua {
+
+/////////////////////////////////////////////////////////////////////////////
+
+namespace atoms
+{
+    ERL_NIF_TERM ok;
+    ERL_NIF_TERM error_lua;
+    ERL_NIF_TERM moon_response;
+    ERL_NIF_TERM moon_callback;
+    ERL_NIF_TERM timeout;
+    ERL_NIF_TERM true_;
+    ERL_NIF_TERM false_;
+    ERL_NIF_TERM nil;
+    ERL_NIF_TERM undefined;
+    ERL_NIF_TERM null;
+
+    void init(ErlNifEnv * env)
+    {
+        ok            = enif_make_atom(env, "ok");
+        error_lua     = enif_make_atom(env, "error_lua");
+        moon_response = enif_make_atom(env, "moon_response");
+        moon_callback = enif_make_atom(env, "moon_callback");
+        timeout       = enif_make_atom(env, "timeout");
+        true_         = enif_make_atom(env, "true");
+        false_        = enif_make_atom(env, "false");
+        nil           = enif_make_atom(env, "nil");
+        undefined     = enif_make_atom(env, "undefined");
+        null          = enif_make_atom(env, "null");
+    }
+}
+
 namespace stack {
 
 /////////////////////////////////////////////////////////////////////////////
 
+static void push_pid(lua_State * vm, ERL_NIF_TERM pid)
+{
+    void* p = lua_newuserdata(vm, sizeof(ERL_NIF_TERM));
+    memcpy(p, &pid, sizeof(ERL_NIF_TERM));
+    luaL_getmetatable(vm, "pid_metatable");
+    lua_setmetatable(vm, -2);
+}
+
+/////////////////////////////////////////////////////////////////////////////
+
+// moon.buffer userdata; view comes first so that C libraries see a
+// moon_buffer_t. The binary is kept alive by a copy in an env of its own
+// (a reference count bump for refc binaries).
+struct buffer_t
+{
+    moon_buffer_t view;
+    ErlNifEnv *   env;
+    ERL_NIF_TERM  term;   // the whole binary, view is [offset, offset + size)
+    std::size_t   offset;
+};
+
+static void push_buffer(lua_State * vm, ErlNifEnv * env, ERL_NIF_TERM term, std::size_t offset, std::size_t size)
+{
+    buffer_t * buffer = static_cast<buffer_t*>(lua_newuserdata(vm, sizeof(buffer_t)));
+    buffer->env = NULL;
+    luaL_getmetatable(vm, MOON_BUFFER);
+    lua_setmetatable(vm, -2);
+
+    ErlNifBinary binary;
+    buffer->env = enif_alloc_env();
+    buffer->term = enif_make_copy(buffer->env, term);
+    if (!enif_inspect_binary(buffer->env, buffer->term, &binary)) {
+        throw errors::invalid_type("invalid_binary");
+    }
+    buffer->view.data = reinterpret_cast<const char*>(binary.data) + offset;
+    buffer->view.size = size;
+    buffer->offset = offset;
+}
+
+static buffer_t * check_buffer(lua_State * vm, int idx)
+{
+    return static_cast<buffer_t*>(luaL_checkudata(vm, idx, MOON_BUFFER));
+}
+
+extern "C"
+{
+    static int buffer_gc(lua_State * vm)
+    {
+        buffer_t * buffer = check_buffer(vm, 1);
+        if (buffer->env) {
+            enif_free_env(buffer->env);
+            buffer->env = NULL;
+        }
+        return 0;
+    }
+
+    static int buffer_len(lua_State * vm)
+    {
+        lua_pushinteger(vm, check_buffer(vm, 1)->view.size);
+        return 1;
+    }
+
+    // buffer:sub(i [, j]) with string.sub indexing; shares the binary.
+    static int buffer_sub(lua_State * vm)
+    {
+        buffer_t * buffer = check_buffer(vm, 1);
+        lua_Integer size = buffer->view.size;
+        lua_Integer i = luaL_checkinteger(vm, 2);
+        lua_Integer j = luaL_optinteger(vm, 3, -1);
+        if (i < 0) i += size + 1;
+        if (j < 0) j += size + 1;
+        if (i < 1) i = 1;
+        if (j > size) j = size;
+        if (i > j) {
+            i = 1;
+            j = 0;
+        }
+        bool exception_caught = false; // because lua_error makes longjump
+        try
+        {
+            push_buffer(vm, buffer->env, buffer->term, buffer->offset + i - 1, j - i + 1);
+            return 1;
+        }
+        catch(std::exception & ex)
+        {
+            lua_pushstring(vm, ex.what());
+            exception_caught = true;
+        }
+        if (exception_caught) {
+            lua_error(vm);
+        }
+        return 0;
+    }
+
+    // Address of the first byte, for ffi.cast.
+    static int buffer_ptr(lua_State * vm)
+    {
+        lua_pushlightuserdata(vm, const_cast<char*>(check_buffer(vm, 1)->view.data));
+        return 1;
+    }
+
+    // Copies the bytes into a Lua string.
+    static int buffer_tostring(lua_State * vm)
+    {
+        buffer_t * buffer = check_buffer(vm, 1);
+        lua_pushlstring(vm, buffer->view.data, buffer->view.size);
+        return 1;
+    }
+
+    static const struct luaL_Reg buffer_methods[] =
+    {
+        {"len", buffer_len},
+        {"sub", buffer_sub},
+        {"ptr", buffer_ptr},
+        {"tostring", buffer_tostring},
+        {NULL, NULL}
+    };
+}
+
+void open_buffer(lua_State * vm)
+{
+    luaL_newmetatable(vm, MOON_BUFFER);
+    lua_pushstring(vm, "type");
+    lua_pushstring(vm, "buffer");
+    lua_rawset(vm, -3);
+    lua_pushcfunction(vm, buffer_gc);
+    lua_setfield(vm, -2, "__gc");
+    lua_pushcfunction(vm, buffer_len);
+    lua_setfield(vm, -2, "__len");
+    lua_pushcfunction(vm, buffer_tostring);
+    lua_setfield(vm, -2, "__tostring");
+    lua_newtable(vm);
+    luaL_register(vm, NULL, buffer_methods);
+    lua_setfield(vm, -2, "__index");
+    lua_pop(vm, 1);
+}
+
+/////////////////////////////////////////////////////////////////////////////
+
 class push_t : public boost::static_visitor<void>
 {
 public :
@@ -38,11 +209,7 @@ public :
         
             
         boost::shared_ptr<ErlNifEnv> env(enif_alloc_env(), enif_free_env);
-        ERL_NIF_TERM pid = enif_make_pid(env.get(), value.ptr()); 
-        void* p = lua_newuserdata(vm_, sizeof(ERL_NIF_TERM));
-        memcpy(p, &pid, sizeof(ERL_NIF_TERM));
-        luaL_getmetatable(vm_, "pid_metatable");
-        lua_setmetatable(vm_, -2);
+        push_pid(vm_, enif_make_pid(env.get(), value.ptr()));
         //std::string str = "erltype_pid";
         //
 		//lua_pushlstring(vm_, str.c_str(), str.size());
@@ -80,27 +247,18 @@ public :
         erlcpp::list_t::const_iterator i, end = value.end();
         for( i = value.begin(); i != end; ++i )
         {
-            try
+            // classified in place: neither exceptions nor copies
+            self_t & self = *this;
+            erlcpp::tuple_t const* tuple = boost::get<erlcpp::tuple_t>(&*i);
+            if (!tuple || (tuple->size() != 2 && tuple->size() != 0))
             {
-                erlcpp::tuple_t tuple = boost::get<erlcpp::tuple_t>(*i);
-
-                if (tuple.size() != 0) {
-                  if (tuple.size() != 2)
-                  {
-                    throw boost::bad_get();
-                  }
-
-                  self_t & self = *this;
-                  boost::apply_visitor(self, tuple[0]);
-                  boost::apply_visitor(self, tuple[1]);
-                  lua_settable(vm_, -3);
-                }
+                boost::apply_visitor(self, *i);
+                lua_rawseti(vm_, -2, index++);
             }
-            catch(boost::bad_get&)
+            else if (tuple->size() == 2)
             {
-                self_t & self = *this;
-                lua_pushinteger(vm_, index++);
-                boost::apply_visitor(self, *i);
+                boost::apply_visitor(self, (*tuple)[0]);
+                boost::apply_visitor(self, (*tuple)[1]);
                 lua_settable(vm_, -3);
             }
         }
@@ -112,9 +270,8 @@ public :
         for( erlcpp::tuple_t::size_type i = 0, end = value.size(); i != end; ++i )
         {
             self_t & self = *this;
-            lua_pushinteger(vm_, i+1);
             boost::apply_visitor(self, value[i]);
-            lua_settable(vm_, -3);
+            lua_rawseti(vm_, -2, i+1);
         }
     }
 
@@ -136,6 +293,202 @@ void push_all(lua_State * vm, erlcpp::list_t const& list)
     std::for_each(list.begin(), list.end(), boost::apply_visitor(p));
 }
 
+/////////////////////////////////////////////////////////////////////////////
+
+// Numbers and binaries, the usual array elements; false for any other type.
+static inline bool push_scalar(lua_State * vm, ErlNifEnv * env, ERL_NIF_TERM term, ErlNifTermType type,
+                               std::size_t buffer_threshold)
+{
+    switch(type)
+    {
+        case ERL_NIF_TERM_TYPE_BITSTRING:
+        {
+            ErlNifBinary binary;
+            if (!enif_inspect_binary(env, term, &binary)) {
+                throw errors::invalid_type("invalid_binary");
+            }
+            if (buffer_threshold && binary.size >= buffer_threshold) {
+                push_buffer(vm, env, term, 0, binary.size);
+            } else {
+                lua_pushlstring(vm, reinterpret_cast<const char*>(binary.data), binary.size);
+            }
+            return true;
+        }
+        case ERL_NIF_TERM_TYPE_INTEGER:
+        {
+            int i32;
+            ErlNifSInt64 i64;
+            if (enif_get_int(env, term, &i32)) {
+                lua_pushinteger(vm, i32);
+            } else if (enif_get_int64(env, term, &i64)) {
+                lua_pushnumber(vm, i64);
+            } else {
+                throw errors::invalid_type("invalid_number");
+            }
+            return true;
+        }
+        case ERL_NIF_TERM_TYPE_FLOAT:
+        {
+            double dbl = 0;
+            enif_get_double(env, term, &dbl);
+            lua_pushnumber(vm, dbl);
+            return true;
+        }
+        default:
+            return false;
+    }
+}
+
+// Same mapping as push_t, driven by enif_term_type.
+void push(lua_State * vm, ErlNifEnv * env, ERL_NIF_TERM term, vm_t * owner)
+{
+    if (!lua_checkstack(vm, 3)) {
+        throw errors::invalid_type("too_deep");
+    }
+
+    std::size_t buffer_threshold = owner ? owner->buffer_threshold() : 0;
+    ErlNifTermType type = enif_term_type(env, term);
+    if (push_scalar(vm, env, term, type, buffer_threshold)) {
+        return;
+    }
+
+    switch(type)
+    {
+        case ERL_NIF_TERM_TYPE_ATOM:
+        {
+            if (enif_is_identical(term, atoms::true_)) {
+                lua_pushboolean(vm, 1);
+            } else if (enif_is_identical(term, atoms::false_)) {
+                lua_pushboolean(vm, 0);
+            } else if (enif_is_identical(term, atoms::nil) || enif_is_identical(term, atoms::undefined)
+                       || enif_is_identical(term, atoms::null)) {
+                lua_pushnil(vm);
+            } else if (owner) {
+                owner->push_atom(vm, env, term);
+            } else {
+                char name[256];
+                int len = enif_get_atom(env, term, name, sizeof(name), ERL_NIF_LATIN1);
+                if (len <= 0) {
+                    throw errors::invalid_type("invalid_atom");
+                }
+                lua_pushlstring(vm, name, len - 1);
+            }
+            return;
+        }
+        case ERL_NIF_TERM_TYPE_PID:
+        {
+            ErlNifPid pid;
+            if (!enif_get_local_pid(env, term, &pid)) {
+                throw errors::invalid_type("invalid_pid");
+            }
+            push_pid(vm, term);
+            return;
+        }
+        case ERL_NIF_TERM_TYPE_LIST:
+        {
+            // improper lists have no length; the table just grows then
+            unsigned length = 0;
+            enif_get_list_length(env, term, &length);
+            lua_createtable(vm, length, 0);
+
+            int32_t index = 1;
+            ERL_NIF_TERM head, tail = term;
+            while(enif_get_list_cell(env, tail, &head, &tail))
+            {
+                // arrays of numbers or binaries skip the pair check and
+                // the recursion (the table is presized for them above)
+                if (push_scalar(vm, env, head, enif_term_type(env, head), buffer_threshold))
+                {
+                    lua_rawseti(vm, -2, index++);
+                    continue;
+                }
+
+                int arity = 0;
+                ERL_NIF_TERM const* pair;
+                if (enif_get_tuple(env, head, &arity, &pair) && (arity == 2 || arity == 0))
+                {
+                    // {Key, Value} sets a field, {} is the empty hash marker
+                    if (arity == 2)
+                    {
+                        push(vm, env, pair[0], owner);
+                        push(vm, env, pair[1], owner);
+                        if (lua_isnil(vm, -2)) {
+                            lua_pop(vm, 2); // a nil key would raise outside of any pcall
+                        } else {
+                            lua_settable(vm, -3);
+                        }
+                    }
+                }
+                else
+                {
+                    push(vm, env, head, owner);
+                    lua_rawseti(vm, -2, index++);
+                }
+            }
+            if (!enif_is_empty_list(env, tail))
+            {
+                push(vm, env, tail, owner);
+                lua_rawseti(vm, -2, index++);
+            }
+            return;
+        }
+        case ERL_NIF_TERM_TYPE_MAP:
+        {
+            std::size_t size = 0;
+            enif_get_map_size(env, term, &size);
+            lua_createtable(vm, 0, size);
+
+            erlcpp::map_iterator_t iter(env, term);
+            ERL_NIF_TERM key, value;
+            while(iter.next(key, value))
+            {
+                push(vm, env, key, owner);
+                push(vm, env, value, owner);
+                if (lua_isnil(vm, -2)) {
+                    lua_pop(vm, 2);
+                } else {
+                    lua_settable(vm, -3);
+                }
+            }
+            return;
+        }
+        case ERL_NIF_TERM_TYPE_TUPLE:
+        {
+            int arity = 0;
+            ERL_NIF_TERM const* items;
+            enif_get_tuple(env, term, &arity, &items);
+            lua_createtable(vm, arity, 0);
+            for( int i = 0; i < arity; ++i )
+            {
+                if (!push_scalar(vm, env, items[i], enif_term_type(env, items[i]), buffer_threshold)) {
+                    push(vm, env, items[i], owner);
+                }
+                lua_rawseti(vm, -2, i + 1);
+            }
+            return;
+        }
+        default:
+            throw errors::unsupported_type();
+    }
+}
+
+int push_all(lua_State * vm, ErlNifEnv * env, ERL_NIF_TERM list, vm_t * owner)
+{
+    int count = 0;
+    ERL_NIF_TERM head, tail = list;
+    while(enif_get_list_cell(env, tail, &head, &tail))
+    {
+        push(vm, env, head, owner);
+        ++count;
+    }
+    if (!enif_is_empty_list(env, tail))
+    {
+        push(vm, env, tail, owner);
+        ++count;
+    }
+    return count;
+}
+
 /////////////////////////////////////////////////////////////////////////////
 /////////////////////////////////////////////////////////////////////////////
 
@@ -167,6 +520,9 @@ erlcpp::term_t peek(lua_State * vm, const void* table_pointer, int depth)
              void* p = lua_touserdata(vm, -1);
              size_t len = *((size_t*)p);
             return erlcpp::atom_t(erlcpp::atom_t::data_t((const char*)(p+sizeof(size_t)), len)); 
+        } else if(strcmp(type, "buffer") == 0) {
+            moon_buffer_t * buffer = (moon_buffer_t*)lua_touserdata(vm, -1);
+            return erlcpp::binary_t(erlcpp::binary_t::data_t(buffer->data, buffer->data + buffer->size));
         } else {
             return default_return;
         }
@@ -308,7 +664,13 @@ erlcpp::term_t pop(lua_State * vm, const void* pointer, int depth)
 
 erlcpp::term_t pop_all(lua_State * vm)
 {
-    switch(int N = lua_gettop(vm))
+    return pop_all(vm, 0);
+}
+
+// Pops every value above base.
+erlcpp::term_t pop_all(lua_State * vm, int base)
+{
+    switch(int N = lua_gettop(vm) - base)
     {
         case 0 : return erlcpp::atom_t("undefined");
         case 1 : return pop(vm);
@@ -326,5 +688,177 @@ erlcpp::term_t pop_all(lua_State * vm)
 
 /////////////////////////////////////////////////////////////////////////////
 
+static ERL_NIF_TERM make_binary(ErlNifEnv * env, const char * data, std::size_t size)
+{
+    ERL_NIF_TERM result;
+    unsigned char * buf = enif_make_new_binary(env, size, &result);
+    if (!buf) {
+        throw errors::enomem();
+    }
+    memcpy(buf, data, size);
+    return result;
+}
+
+static ERL_NIF_TERM make_typename(ErlNifEnv * env, lua_State * vm)
+{
+    std::string v = "luatype_";
+    v += lua_typename(vm, lua_type(vm, -1));
+    return make_binary(env, v.data(), v.size());
+}
+
+// Same mapping as peek above, written straight into env: strings are
+// copied once into the binary and tables are encoded in a single pass.
+// With maps, hash tables come back as maps instead of {Key, Value} lists.
+ERL_NIF_TERM peek(ErlNifEnv * env, lua_State * vm, const void* table_pointer, int depth, bool maps)
+{
+  switch( lua_type(vm, -1) )
+  {
+    case LUA_TUSERDATA:
+      {
+        if (!luaL_getmetafield(vm, -1, "type")) {
+          return make_typename(env, vm);
+        }
+        const char * type = lua_tostring(vm, -1);
+        bool is_pid = type && !strcmp(type, "pid");
+        bool is_atom = type && !strcmp(type, "atom");
+        bool is_buffer = type && !strcmp(type, "buffer");
+        lua_pop(vm, 1);
+
+        if (is_pid) {
+          ErlNifPid pid;
+          ERL_NIF_TERM term = *static_cast<ERL_NIF_TERM*>(lua_touserdata(vm, -1));
+          if (enif_get_local_pid(env, term, &pid)) {
+            return enif_make_pid(env, &pid);
+          }
+        } else if (is_atom) {
+          const char * p = static_cast<const char*>(lua_touserdata(vm, -1));
+          std::size_t len = *reinterpret_cast<const std::size_t*>(p);
+          return enif_make_atom_len(env, p + sizeof(std::size_t), len);
+        } else if (is_buffer) {
+          // back to Erlang as (a sub binary of) the binary it came from
+          buffer_t * buffer = static_cast<buffer_t*>(lua_touserdata(vm, -1));
+          return enif_make_sub_binary(env, enif_make_copy(env, buffer->term), buffer->offset, buffer->view.size);
+        }
+        return make_typename(env, vm);
+      }
+    case LUA_TNIL:
+      return atoms::nil;
+    case LUA_TBOOLEAN:
+      return lua_toboolean(vm, -1) ? atoms::true_ : atoms::false_;
+    case LUA_TNUMBER:
+      {
+        lua_Number  d = lua_tonumber(vm, -1);
+        lua_Integer i = lua_tointeger(vm, -1);
+        if (d != i) {
+          return enif_make_double(env, d);
+        }
+        return enif_make_int64(env, i);
+      }
+    case LUA_TSTRING:
+      {
+        std::size_t len = 0;
+        const char * val = lua_tolstring(vm, -1, &len);
+        return make_binary(env, val, len);
+      }
+    case LUA_TTABLE:
+      {
+        const void* pointer = lua_topointer(vm, -1);
+        if (table_pointer == pointer) {
+          return make_binary(env, "(table_self)", 12);
+        }
+        if (depth >= MAX_DEPTH || !lua_checkstack(vm, 3)) {
+          return make_binary(env, "(table)", 7);
+        }
+
+        // the values of the table; their keys are only kept once one turns
+        // out not to be the next index
+        std::vector<ERL_NIF_TERM> items, keys;
+        items.reserve(lua_objlen(vm, -1));
+        bool is_hash = false;
+
+        lua_pushnil(vm);
+        for(lua_Integer index = 1; lua_next(vm, -2); ++index)
+        {
+          ERL_NIF_TERM val = pop(env, vm, pointer, depth + 1, maps);
+          if (!is_hash && lua_type(vm, -1) == LUA_TNUMBER && lua_tonumber(vm, -1) == index)
+          {
+            items.push_back(val);
+            continue;
+          }
+          if (!is_hash)
+          {
+            keys.reserve(items.capacity());
+            for(std::size_t i = 0; i < items.size(); ++i)
+            {
+              keys.push_back(enif_make_int64(env, i + 1));
+            }
+            is_hash = true;
+          }
+          keys.push_back(peek(env, vm, NULL, 0, maps));
+          items.push_back(val);
+        }
+
+        if (is_hash)
+        {
+          ERL_NIF_TERM map;
+          if (maps && enif_make_map_from_arrays(env, keys.data(), items.data(), items.size(), &map)) {
+            return map;
+          }
+          for(std::size_t i = 0; i < items.size(); ++i)
+          {
+            items[i] = enif_make_tuple2(env, keys[i], items[i]);
+          }
+        }
+        else if (items.empty())
+        {
+          int top = lua_gettop(vm);
+          bool empty_hash = luaL_getmetafield(vm, -1, "is_hash") && lua_toboolean(vm, -1);
+          lua_settop(vm, top);
+          if (empty_hash && maps) {
+            return enif_make_new_map(env);
+          } else if (empty_hash) {
+            ERL_NIF_TERM marker = enif_make_tuple_from_array(env, NULL, 0);
+            return enif_make_list_from_array(env, &marker, 1);
+          }
+        }
+        return enif_make_list_from_array(env, items.data(), items.size());
+      }
+    default :
+      return make_typename(env, vm);
+  }
+}
+
+ERL_NIF_TERM pop(ErlNifEnv * env, lua_State * vm)
+{
+    return pop(env, vm, NULL, 0);
+}
+
+ERL_NIF_TERM pop(ErlNifEnv * env, lua_State * vm, const void* pointer, int depth, bool maps)
+{
+    ERL_NIF_TERM result = peek(env, vm, pointer, depth, maps);
+    lua_pop(vm, 1);
+    return result;
+}
+
+ERL_NIF_TERM pop_all(ErlNifEnv * env, lua_State * vm, int base, bool maps)
+{
+    switch(int N = lua_gettop(vm) - base)
+    {
+        case 0 : return atoms::undefined;
+        case 1 : return pop(env, vm, NULL, 0, maps);
+        default:
+        {
+            std::vector<ERL_NIF_TERM> result(N);
+            while(N)
+            {
+                result[--N] = pop(env, vm, NULL, 0, maps);
+            }
+            return enif_make_tuple_from_array(env, result.data(), result.size());
+        }
+    }
+}
+
+/////////////////////////////////////////////////////////////////////////////
+
 } // namespace stack
 } // namespace lua
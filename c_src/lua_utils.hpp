@@ -7,22 +7,64 @@ namespace lua {
 
 /////////////////////////////////////////////////////////////////////////////
 
+// Atoms put in every result, made once when the NIF library is loaded
+// (an atom term is valid in any env).
+namespace atoms
+{
+    extern ERL_NIF_TERM ok;
+    extern ERL_NIF_TERM error_lua;
+    extern ERL_NIF_TERM moon_response;
+    extern ERL_NIF_TERM moon_callback;
+    extern ERL_NIF_TERM timeout;
+    extern ERL_NIF_TERM true_;
+    extern ERL_NIF_TERM false_;
+    extern ERL_NIF_TERM nil;
+    extern ERL_NIF_TERM undefined;
+    extern ERL_NIF_TERM null;
+
+    void init(ErlNifEnv * env);
+}
+
+/////////////////////////////////////////////////////////////////////////////
+
+class exec_lock_t
+{
+public :
+    exec_lock_t(vm_t & vm) : vm_(vm) { vm_.lock(); }
+    ~exec_lock_t() { vm_.unlock(); }
+private :
+    vm_t & vm_;
+};
+
+/////////////////////////////////////////////////////////////////////////////
+
 template <class worker_t>
-typename worker_t::result_type
+void
 perform_task(vm_t & vm)
 {
     vm_t::task_t task = vm.get_task();
     worker_t worker(vm);
-    return boost::apply_visitor(worker, task);
+    exec_lock_t lock(vm);
+    boost::apply_visitor(worker, task);
+    vm.task_done();
 }
 
+// Runs (at most max) tasks that are already queued without parking in
+// between; returns the number of tasks performed.
 template <class worker_t>
-typename worker_t::result_type
-perform_resp_task(vm_t & vm)
+std::size_t
+perform_ready_tasks(vm_t & vm, std::size_t max = std::size_t(-1))
 {
-    vm_t::task_t task = vm.get_resp_task();
+    std::size_t count = 0;
     worker_t worker(vm);
-    return boost::apply_visitor(worker, task);
+    for(boost::optional<vm_t::task_t> task; count < max && (task = vm.try_get_task()); )
+    {
+        exec_lock_t lock(vm);
+        boost::apply_visitor(worker, *task);
+        vm.task_done();
+        ++count;
+    }
+    return count;
 }
 
 
@@ -36,26 +78,42 @@ void send_result(vm_t & vm, std::string const& type, result_t const& result)
     enif_send(NULL, vm.erl_pid().ptr(), env.get(), erlcpp::to_erl(env.get(), packet));
 }
 
-template <class result_t>
-int send_result_caller(vm_t & vm, std::string const& type, result_t const& result, erlcpp::lpid_t const& caller)
+// {Type, Tag, Result} to the caller of a task; Tag is the ref of the task
+// (a term of any env), or the caller pid when it has none.
+inline int send_result_caller(vm_t & vm, ERL_NIF_TERM type, ErlNifEnv * env, ERL_NIF_TERM result,
+                              erlcpp::lpid_t const& caller, ERL_NIF_TERM ref)
 {
-    boost::shared_ptr<ErlNifEnv> env(enif_alloc_env(), enif_free_env);
-    erlcpp::tuple_t packet(3);
-    packet[0] = erlcpp::atom_t(type);
-    packet[1] = result;
-	packet[2] = caller;
-    return enif_send(NULL, caller.ptr(), env.get(), erlcpp::to_erl(env.get(), packet));
+    ERL_NIF_TERM tag = ref ? enif_make_copy(env, ref) : enif_make_pid(env, caller.ptr());
+    ERL_NIF_TERM packet = enif_make_tuple3(env, type, tag, result);
+    return enif_send(NULL, caller.ptr(), env, packet);
 }
 
 template <class result_t>
-int send_result_vm_with_caller(vm_t & vm, std::string const& type, result_t const& result, erlcpp::lpid_t const& caller)
+int send_result_caller(vm_t & vm, std::string const& type, result_t const& result, erlcpp::lpid_t const& caller,
+                       ERL_NIF_TERM ref)
 {
     boost::shared_ptr<ErlNifEnv> env(enif_alloc_env(), enif_free_env);
-    erlcpp::tuple_t packet(3);
-    packet[0] = erlcpp::atom_t(type);
-    packet[1] = result;
-	packet[2] = caller;
-    return enif_send(NULL, vm.erl_pid().ptr(), env.get(), erlcpp::to_erl(env.get(), packet));
+    return send_result_caller(vm, erlcpp::to_erl(env.get(), erlcpp::atom_t(type)), env.get(),
+                              erlcpp::to_erl(env.get(), result), caller, ref);
+}
+
+inline int send_result_vm_with_caller(vm_t & vm, ERL_NIF_TERM type, ErlNifEnv * env, ERL_NIF_TERM result, erlcpp::lpid_t const& caller, uint64_t id)
+{
+    ERL_NIF_TERM packet = enif_make_tuple4(env, type, result,
+        enif_make_pid(env, caller.ptr()), enif_make_uint64(env, id));
+    return enif_send(NULL, vm.erl_pid().ptr(), env, packet);
+}
+
+// A callback the caller answers itself while it waits for its reply,
+// tagged like the reply of the task; the VM resource comes along for the
+// moon_nif:result.
+inline int send_callback_caller(vm_t & vm, ERL_NIF_TERM type, ErlNifEnv * env, ERL_NIF_TERM result,
+                                erlcpp::lpid_t const& caller, ERL_NIF_TERM ref, uint64_t id)
+{
+    ERL_NIF_TERM tag = ref ? enif_make_copy(env, ref) : enif_make_pid(env, caller.ptr());
+    ERL_NIF_TERM packet = enif_make_tuple5(env, type, result,
+        tag, enif_make_uint64(env, id), enif_make_resource(env, &vm));
+    return enif_send(NULL, caller.ptr(), env, packet);
 }
 
 
@@ -67,15 +125,21 @@ class stack_guard_t
 {
 public :
     stack_guard_t(vm_t & vm)
-        : vm_(vm)
-        , top_(lua_gettop(vm_.state()))
+        : state_(vm.state())
+        , top_(lua_gettop(state_))
+        , dismissed_(false)
+    {};
+
+    stack_guard_t(lua_State * state)
+        : state_(state)
+        , top_(lua_gettop(state_))
         , dismissed_(false)
     {};
 
     ~stack_guard_t()
     {
         if(!dismissed_) {
-            lua_settop(vm_.state(), top_);
+            lua_settop(state_, top_);
         }
     }
 
@@ -84,11 +148,23 @@ public :
         dismissed_ = true;
     }
 private :
-    vm_t & vm_;
+    lua_State * state_;
     int top_;
     bool dismissed_;
 };
 
+class budget_guard_t
+{
+public :
+    budget_guard_t(vm_t & vm, lua_State * thread) : vm_(vm), thread_(thread), co_(NULL) { vm_.arm_budget(thread_); }
+    budget_guard_t(vm_t & vm, vm_t::coroutine_t & co) : vm_(vm), thread_(co.thread), co_(&co) { vm_.arm_budget(thread_, co_); }
+    ~budget_guard_t() { vm_.disarm_budget(thread_, co_); }
+private :
+    vm_t & vm_;
+    lua_State * thread_;
+    vm_t::coroutine_t * co_;
+};
+
 /////////////////////////////////////////////////////////////////////////////
 
 namespace stack
@@ -96,9 +172,26 @@ namespace stack
     erlcpp::term_t pop(lua_State * vm);
     erlcpp::term_t pop(lua_State * vm, const void* pointer, int depth);
     erlcpp::term_t pop_all(lua_State * vm);
+    erlcpp::term_t pop_all(lua_State * vm, int base);
+
+    // Encode straight into env, without building an erlcpp tree first;
+    // with maps, Lua hash tables become maps rather than proplists.
+    ERL_NIF_TERM pop(ErlNifEnv * env, lua_State * vm);
+    ERL_NIF_TERM pop(ErlNifEnv * env, lua_State * vm, const void* pointer, int depth, bool maps = false);
+    ERL_NIF_TERM pop_all(ErlNifEnv * env, lua_State * vm, int base = 0, bool maps = false);
 
     void push(lua_State * vm, erlcpp::term_t const& val);
     void push_all(lua_State * vm, erlcpp::list_t const& list);
+
+    // Converts straight from the term (which must live in env) without
+    // building an erlcpp tree; push_all returns the number of values pushed.
+    // With an owner, its buffer_threshold and atom intern table apply;
+    // without one, binaries and atoms are always pushed as fresh strings.
+    void push(lua_State * vm, ErlNifEnv * env, ERL_NIF_TERM term, vm_t * owner = NULL);
+    int push_all(lua_State * vm, ErlNifEnv * env, ERL_NIF_TERM list, vm_t * owner = NULL);
+
+    // Creates the moon.buffer metatable.
+    void open_buffer(lua_State * vm);
 }
 
 /////////////////////////////////////////////////////////////////////////////
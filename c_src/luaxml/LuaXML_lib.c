@@ -37,6 +37,8 @@ THE SOFTWARE.
 #include <lauxlib.h>
 #include <lualib.h>
 
+#include "../moon_buffer.h"
+
 #include <stdio.h>
 #include <string.h>
 #include <ctype.h>
@@ -268,9 +270,9 @@ static void Xml_pushDecode(lua_State* L, const char* s, size_t s_size) {
 int Xml_eval(lua_State *L) {
 	char* str = 0;
 	size_t str_size=0;
-	if(lua_isuserdata(L,1)) str = (char*)lua_touserdata(L,1);
-	else {
-		const char * sTmp = luaL_checklstring(L,1,&str_size);
+	if(lua_isuserdata(L,1) && !moon_tobuffer(L,1)) str = (char*)lua_touserdata(L,1);
+	else { // strings and moon.buffers are copied, the tokenizer needs a terminated string
+		const char * sTmp = moon_checklbuffer(L,1,&str_size);
 		str = (char*)malloc(str_size+1);
 		memcpy(str, sTmp, str_size);
 		str[str_size]=0;
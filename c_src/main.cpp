@@ -1,6 +1,10 @@
 #include "lua.hpp"
 #include "types.hpp"
 #include "utils.hpp"
+#include "lua_utils.hpp"
+#include "chunk_cache.hpp"
+
+#include <dlfcn.h>
 
 
 using namespace erlcpp;
@@ -14,12 +18,258 @@ static struct {
     ERL_NIF_TERM invalid_args;
     ERL_NIF_TERM invalid_type;
     ERL_NIF_TERM not_implemented;
+    ERL_NIF_TERM runtime;
+    ERL_NIF_TERM pooled;
+    ERL_NIF_TERM max_instructions;
+    ERL_NIF_TERM max_cpu_time;
+    ERL_NIF_TERM queue_size;
+    ERL_NIF_TERM overloaded;
+    ERL_NIF_TERM queue_len;
+    ERL_NIF_TERM capacity;
+    ERL_NIF_TERM high_water;
+    ERL_NIF_TERM expired;
+    ERL_NIF_TERM busy_time;
+    ERL_NIF_TERM tasks;
+    ERL_NIF_TERM async;
+    ERL_NIF_TERM running;
+    ERL_NIF_TERM suspended;
+    ERL_NIF_TERM fair_queuing;
+    ERL_NIF_TERM true_;
+    ERL_NIF_TERM undefined;
+    ERL_NIF_TERM buffer_threshold;
+    ERL_NIF_TERM return_maps;
+    ERL_NIF_TERM not_a_function;
+    ERL_NIF_TERM chunk_cache_dir;
+    ERL_NIF_TERM chunk_cache_size;
+    ERL_NIF_TERM libs;
 } atoms;
 
 /////////////////////////////////////////////////////////////////////////////
 
 static ErlNifResourceType * res_type = 0;
 
+// LuaJIT made global once for the whole library, so that C modules loaded
+// by require find its symbols.
+static void * luajit = 0;
+
+// Worker pool shared by all VMs started with {runtime, pooled}; created on
+// first use and sized to the number of BEAM schedulers (i.e. the cores).
+static lua::scheduler_t * scheduler = 0;
+static ErlNifMutex * scheduler_lock = 0;
+
+static lua::scheduler_t * get_scheduler()
+{
+    enif_mutex_lock(scheduler_lock);
+    if (!scheduler)
+    {
+        ErlNifSysInfo info;
+        enif_system_info(&info, sizeof(info));
+        scheduler = new lua::scheduler_t(info.scheduler_threads);
+    }
+    enif_mutex_unlock(scheduler_lock);
+    return scheduler;
+}
+
+static lua::vm_t::options_t get_options(ErlNifEnv* env, ERL_NIF_TERM list)
+{
+    lua::vm_t::options_t result;
+
+    ERL_NIF_TERM head, tail = list;
+    while(enif_get_list_cell(env, tail, &head, &tail))
+    {
+        int arity = 0;
+        ERL_NIF_TERM const* option;
+        if (!enif_get_tuple(env, head, &arity, &option) || arity != 2) {
+            continue; // not ours (e.g. the moon_vm callback)
+        }
+
+        if (enif_is_identical(option[0], atoms.runtime))
+        {
+            if (enif_is_identical(option[1], atoms.pooled)) {
+                result.scheduler = get_scheduler();
+            }
+        }
+        else if (enif_is_identical(option[0], atoms.max_instructions))
+        {
+            ErlNifUInt64 value = 0;
+            if (enif_get_uint64(env, option[1], &value)) {
+                result.max_instructions = value;
+            }
+        }
+        else if (enif_is_identical(option[0], atoms.max_cpu_time))
+        {
+            // given in milliseconds
+            ErlNifUInt64 value = 0;
+            if (enif_get_uint64(env, option[1], &value)) {
+                result.max_cpu_time = value * 1000;
+            }
+        }
+        else if (enif_is_identical(option[0], atoms.fair_queuing))
+        {
+            result.fair_queuing = enif_is_identical(option[1], atoms.true_);
+        }
+        else if (enif_is_identical(option[0], atoms.queue_size))
+        {
+            ErlNifUInt64 value = 0;
+            if (enif_get_uint64(env, option[1], &value) && value > 0) {
+                result.queue_size = value;
+            }
+        }
+        else if (enif_is_identical(option[0], atoms.return_maps))
+        {
+            result.return_maps = enif_is_identical(option[1], atoms.true_);
+        }
+        else if (enif_is_identical(option[0], atoms.buffer_threshold))
+        {
+            ErlNifUInt64 value = 0;
+            if (enif_get_uint64(env, option[1], &value)) {
+                result.buffer_threshold = value;
+            }
+        }
+        else if (enif_is_identical(option[0], atoms.libs))
+        {
+            ERL_NIF_TERM lib, libs = option[1];
+            while(enif_get_list_cell(env, libs, &lib, &libs))
+            {
+                std::string name = from_erl<atom_t>(env, lib);
+                if (!lua::vm_t::known_lib(name)) {
+                    throw errors::invalid_type("unknown_lib");
+                }
+                result.libs.push_back(name);
+            }
+        }
+    }
+    return result;
+}
+
+// load_info is the moon application env: [{chunk_cache_dir, Dir}, {chunk_cache_size, Bytes}].
+static lua::chunk_cache::options_t get_chunk_cache_options(ErlNifEnv* env, ERL_NIF_TERM list)
+{
+    lua::chunk_cache::options_t result;
+
+    ERL_NIF_TERM head, tail = list;
+    while(enif_get_list_cell(env, tail, &head, &tail))
+    {
+        int arity = 0;
+        ERL_NIF_TERM const* option;
+        if (!enif_get_tuple(env, head, &arity, &option) || arity != 2) {
+            continue;
+        }
+
+        if (enif_is_identical(option[0], atoms.chunk_cache_dir))
+        {
+            char dir[4096];
+            ErlNifBinary bin;
+            if (enif_get_string(env, option[1], dir, sizeof(dir), ERL_NIF_LATIN1) > 0) {
+                result.dir = dir;
+            } else if (enif_inspect_binary(env, option[1], &bin)) {
+                result.dir.assign(bin.data, bin.data + bin.size);
+            }
+        }
+        else if (enif_is_identical(option[0], atoms.chunk_cache_size))
+        {
+            ErlNifUInt64 value = 0;
+            if (enif_get_uint64(env, option[1], &value)) {
+                result.max_bytes = value;
+            }
+        }
+    }
+    return result;
+}
+
+// Deleter for envs owned by the NIF call itself.
+static void borrow_env(ErlNifEnv *) {}
+
+// Fun is the name of a global function or a handle from moon_nif:prepare.
+static lua::vm_t::tasks::call_t make_call(ErlNifEnv * env, lua::vm_t * vm, ERL_NIF_TERM fun,
+                                          boost::shared_ptr<ErlNifEnv> const& args_env, ERL_NIF_TERM args,
+                                          lpid_t const& caller)
+{
+    boost::shared_ptr<lua::vm_t::prepared_t> prepared = vm->get_prepared(env, fun);
+    if (prepared)
+    {
+        return lua::vm_t::tasks::call_t(prepared, args_env, args, caller);
+    }
+    return lua::vm_t::tasks::call_t(from_erl<atom_t>(env, fun), args_env, args, caller);
+}
+
+// The caller argument of the task NIFs: a pid, or {Pid, Ref} (like a
+// gen_server From) to have the moon_response tagged with Ref instead of
+// the pid. Ref is copied into the env of the task.
+struct task_caller_t
+{
+    task_caller_t() : term(0), ref(0), async(false) {}
+    lpid_t       pid;
+    ERL_NIF_TERM term; // the pid, also the default fair queuing flow
+    ERL_NIF_TERM ref;
+    bool         async;
+};
+
+static task_caller_t get_caller(ErlNifEnv* env, ERL_NIF_TERM caller, ErlNifEnv* task_env)
+{
+    task_caller_t result;
+    result.term = caller;
+    int arity = 0;
+    ERL_NIF_TERM const* from;
+    // Pid, {Pid, Ref} or {Pid, Ref, async}
+    if (enif_get_tuple(env, caller, &arity, &from) && (arity == 2 || arity == 3))
+    {
+        result.term = from[0];
+        result.ref = enif_make_copy(task_env, from[1]);
+        result.async = arity == 3 && enif_is_identical(from[2], atoms.async);
+    }
+    result.pid = from_erl<lpid_t>(env, result.term);
+    return result;
+}
+
+// The optional trailing Timeout argument (milliseconds or infinity) of the
+// task NIFs, turned into an absolute deadline.
+static uint64_t get_deadline(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[], int index)
+{
+    ErlNifUInt64 timeout = 0;
+    if (argc > index && enif_get_uint64(env, argv[index], &timeout)) {
+        return lua::monotonic_time() + timeout * 1000;
+    }
+    return 0;
+}
+
+// Fair queuing flow of a task: the optional trailing {Tenant, Weight}
+// argument of the task NIFs, or the calling process when it is undefined.
+// Only worked out for VMs that do fair queuing.
+struct task_flow_t
+{
+    task_flow_t() : weight(1) {}
+    lua::vm_t::flow_key_t key;
+    unsigned weight;
+};
+
+static task_flow_t get_flow(ErlNifEnv* env, lua::vm_t const* vm, int argc, const ERL_NIF_TERM argv[], int index, ERL_NIF_TERM caller)
+{
+    task_flow_t result;
+    if (!vm->fair_queuing()) return result;
+    ERL_NIF_TERM tenant = caller;
+
+    int arity = 0;
+    ERL_NIF_TERM const* tag;
+    if (argc > index && enif_get_tuple(env, argv[index], &arity, &tag) && arity == 2
+        && !enif_is_identical(tag[0], atoms.undefined))
+    {
+        tenant = tag[0];
+        enif_get_uint(env, tag[1], &result.weight);
+        if (!result.weight) result.weight = 1;
+    }
+
+    // the whole term rather than a hash of it: tenants never share a flow
+    ErlNifBinary bin;
+    if (!enif_term_to_binary(env, tenant, &bin))
+    {
+        throw errors::enomem();
+    }
+    result.key.assign(reinterpret_cast<char const*>(bin.data), bin.size);
+    enif_release_binary(&bin);
+    return result;
+}
+
 static int init(ErlNifEnv *env, void **priv, ERL_NIF_TERM load_info)
 {
     atoms.ok                = enif_make_atom(env, "ok");
@@ -28,19 +278,58 @@ static int init(ErlNifEnv *env, void **priv, ERL_NIF_TERM load_info)
     atoms.invalid_args      = enif_make_atom(env, "invalid_args");
     atoms.invalid_type      = enif_make_atom(env, "invalid_type");
     atoms.not_implemented   = enif_make_atom(env, "not_implemented");
+    atoms.runtime           = enif_make_atom(env, "runtime");
+    atoms.pooled            = enif_make_atom(env, "pooled");
+    atoms.max_instructions  = enif_make_atom(env, "max_instructions");
+    atoms.max_cpu_time      = enif_make_atom(env, "max_cpu_time");
+    atoms.queue_size        = enif_make_atom(env, "queue_size");
+    atoms.overloaded        = enif_make_atom(env, "overloaded");
+    atoms.queue_len         = enif_make_atom(env, "queue_len");
+    atoms.capacity          = enif_make_atom(env, "capacity");
+    atoms.high_water        = enif_make_atom(env, "high_water");
+    atoms.expired           = enif_make_atom(env, "expired");
+    atoms.busy_time         = enif_make_atom(env, "busy_time");
+    atoms.tasks             = enif_make_atom(env, "tasks");
+    atoms.async             = enif_make_atom(env, "async");
+    atoms.running           = enif_make_atom(env, "running");
+    atoms.suspended         = enif_make_atom(env, "suspended");
+    atoms.fair_queuing      = enif_make_atom(env, "fair_queuing");
+    atoms.true_             = enif_make_atom(env, "true");
+    atoms.undefined         = enif_make_atom(env, "undefined");
+    atoms.buffer_threshold  = enif_make_atom(env, "buffer_threshold");
+    atoms.return_maps       = enif_make_atom(env, "return_maps");
+    atoms.not_a_function    = enif_make_atom(env, "not_a_function");
+    atoms.chunk_cache_dir   = enif_make_atom(env, "chunk_cache_dir");
+    atoms.chunk_cache_size  = enif_make_atom(env, "chunk_cache_size");
+    atoms.libs              = enif_make_atom(env, "libs");
+    lua::atoms::init(env);
+    lua::chunk_cache::init(get_chunk_cache_options(env, load_info));
+
+    luajit = dlopen("/usr/local/lib/libluajit-5.1.so", RTLD_NOW | RTLD_GLOBAL);
+    if (!scheduler_lock) {
+        scheduler_lock = enif_mutex_create(const_cast<char*>("moon.scheduler.lock"));
+    }
 
     res_type = enif_open_resource_type(
         env, "lua", "lua_vm", lua::vm_t::destroy,
         static_cast<ErlNifResourceFlags>(ERL_NIF_RT_CREATE | ERL_NIF_RT_TAKEOVER), NULL
     );
 
-    return (!!res_type) ? 0 : -1;
+    lua::vm_t::prepared_t::resource_type = enif_open_resource_type(
+        env, "lua", "lua_fun", lua::vm_t::prepared_t::destroy,
+        static_cast<ErlNifResourceFlags>(ERL_NIF_RT_CREATE | ERL_NIF_RT_TAKEOVER), NULL
+    );
+
+    return (res_type && lua::vm_t::prepared_t::resource_type) ? 0 : -1;
 }
 
 static int upgrade(ErlNifEnv* env, void** priv_data, void** old_priv_data, ERL_NIF_TERM load_info) {
     return 0;
 }
 
+// VM resources may outlive this module, and pooled ones keep scheduling
+// themselves on the workers: the scheduler, the chunk cache and luajit
+// are never freed.
 static void unload(ErlNifEnv *env, void *priv_data)
 {
 }
@@ -58,7 +347,12 @@ static ERL_NIF_TERM start(ErlNifEnv * env, int argc, const ERL_NIF_TERM argv[])
         }
 
         lpid_t pid = from_erl<lpid_t>(env, argv[0]);
-        boost::shared_ptr<lua::vm_t> vm = lua::vm_t::create(res_type, pid);
+        lua::vm_t::options_t options;
+        if (argc > 1)
+        {
+            options = get_options(env, argv[1]);
+        }
+        boost::shared_ptr<lua::vm_t> vm = lua::vm_t::create(res_type, pid, options);
         ERL_NIF_TERM result = enif_make_resource(env, vm.get());
         return enif_make_tuple2(env, atoms.ok, result);
     }
@@ -83,10 +377,19 @@ static ERL_NIF_TERM load(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[])
             return enif_make_badarg(env);
         }
 
-        binary_t file = from_erl<binary_t>(env, argv[1]);
-		lpid_t 	 caller_pid = from_erl<lpid_t>(env, argv[2]);
-        lua::vm_t::tasks::load_t load(file, caller_pid);
-        vm->add_task(lua::vm_t::task_t(load));
+        if (!enif_is_binary(env, argv[1]))
+        {
+            return enif_make_badarg(env);
+        }
+
+        boost::shared_ptr<ErlNifEnv> file_env(enif_alloc_env(), enif_free_env);
+		task_caller_t caller = get_caller(env, argv[2], file_env.get());
+        ERL_NIF_TERM file = enif_make_copy(file_env.get(), argv[1]);
+        lua::vm_t::tasks::load_t load(file_env, file, caller.pid, get_deadline(env, argc, argv, 3), caller.ref);
+        task_flow_t flow = get_flow(env, vm, argc, argv, 4, caller.term);
+        if (!vm->add_task(lua::vm_t::task_t(load), flow.key, flow.weight)) {
+            return enif_make_tuple2(env, atoms.error, atoms.overloaded);
+        }
 
         return atoms.ok;
     }
@@ -111,10 +414,33 @@ static ERL_NIF_TERM eval(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[])
             return enif_make_badarg(env);
         }
 
-        binary_t script = from_erl<binary_t>(env, argv[1]);
-		lpid_t   caller_pid = from_erl<lpid_t>(env, argv[2]);
-        lua::vm_t::tasks::eval_t eval(script, caller_pid);
-        vm->add_task(lua::vm_t::task_t(eval));
+        if (!enif_is_binary(env, argv[1]))
+        {
+            return enif_make_badarg(env);
+        }
+
+        // a refc binary is shared, not copied; the VM thread reads it in place
+        boost::shared_ptr<ErlNifEnv> code_env(enif_alloc_env(), enif_free_env);
+		task_caller_t caller = get_caller(env, argv[2], code_env.get());
+        ERL_NIF_TERM script = enif_make_copy(code_env.get(), argv[1]);
+        ERL_NIF_TERM bindings = 0;
+        size_t size = 0;
+        if (argc > 5)
+        {
+            if (!enif_get_map_size(env, argv[5], &size))
+            {
+                return enif_make_badarg(env);
+            }
+            if (size > 0)
+            {
+                bindings = enif_make_copy(code_env.get(), argv[5]);
+            }
+        }
+        lua::vm_t::tasks::eval_t eval(code_env, script, caller.pid, get_deadline(env, argc, argv, 3), bindings, caller.ref);
+        task_flow_t flow = get_flow(env, vm, argc, argv, 4, caller.term);
+        if (!vm->add_task(lua::vm_t::task_t(eval), flow.key, flow.weight)) {
+            return enif_make_tuple2(env, atoms.error, atoms.overloaded);
+        }
 
         return atoms.ok;
     }
@@ -139,11 +465,22 @@ static ERL_NIF_TERM call(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[])
             return enif_make_badarg(env);
         }
 
-        atom_t fun = from_erl<atom_t>(env, argv[1]);
-        list_t args = from_erl<list_t>(env, argv[2]);
-		lpid_t caller_pid = from_erl<lpid_t>(env, argv[3]);
-        lua::vm_t::tasks::call_t call(fun, args, caller_pid);
-        vm->add_task(lua::vm_t::task_t(call));
+        if (!enif_is_list(env, argv[2]))
+        {
+            return enif_make_badarg(env);
+        }
+
+        boost::shared_ptr<ErlNifEnv> args_env(enif_alloc_env(), enif_free_env);
+		task_caller_t caller = get_caller(env, argv[3], args_env.get());
+        ERL_NIF_TERM args = enif_make_copy(args_env.get(), argv[2]);
+        lua::vm_t::tasks::call_t call = make_call(env, vm, argv[1], args_env, args, caller.pid);
+        call.deadline = get_deadline(env, argc, argv, 4);
+        call.ref = caller.ref;
+        call.async = caller.async;
+        task_flow_t flow = get_flow(env, vm, argc, argv, 5, caller.term);
+        if (!vm->add_task(lua::vm_t::task_t(call), flow.key, flow.weight)) {
+            return enif_make_tuple2(env, atoms.error, atoms.overloaded);
+        }
 
         return atoms.ok;
     }
@@ -153,12 +490,168 @@ static ERL_NIF_TERM call(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[])
     }
 }
 
+static ERL_NIF_TERM call_batch(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[])
+{
+    try
+    {
+        if (argc < 3)
+        {
+            return enif_make_badarg(env);
+        }
+
+        lua::vm_t * vm = NULL;
+        if(!enif_get_resource(env, argv[0], res_type, reinterpret_cast<void**>(&vm)))
+        {
+            return enif_make_badarg(env);
+        }
+
+        // only the shape is checked here; names and arguments are converted
+        // by the VM thread from one copy of the whole batch
+        ERL_NIF_TERM head, tail = argv[1];
+        while(enif_get_list_cell(env, tail, &head, &tail))
+        {
+            int arity = 0;
+            ERL_NIF_TERM const* call;
+            if (!enif_get_tuple(env, head, &arity, &call) || arity != 2
+                || !enif_is_list(env, call[1]))
+            {
+                return enif_make_badarg(env);
+            }
+        }
+        if (!enif_is_empty_list(env, tail))
+        {
+            return enif_make_badarg(env);
+        }
+
+        boost::shared_ptr<ErlNifEnv> calls_env(enif_alloc_env(), enif_free_env);
+        task_caller_t caller = get_caller(env, argv[2], calls_env.get());
+        ERL_NIF_TERM calls = enif_make_copy(calls_env.get(), argv[1]);
+        lua::vm_t::tasks::call_batch_t batch(calls_env, calls, caller.pid, get_deadline(env, argc, argv, 3), caller.ref);
+        task_flow_t flow = get_flow(env, vm, argc, argv, 4, caller.term);
+        if (!vm->add_task(lua::vm_t::task_t(batch), flow.key, flow.weight)) {
+            return enif_make_tuple2(env, atoms.error, atoms.overloaded);
+        }
+
+        return atoms.ok;
+    }
+    catch( std::exception & ex )
+    {
+        return enif_make_tuple2(env, atoms.error, enif_make_atom(env, ex.what()));
+    }
+}
+
+// Runs on a dirty CPU scheduler: the Lua function is executed right here
+// while holding the VM, and its result is returned instead of being sent.
+static ERL_NIF_TERM call_sync(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[])
+{
+    try
+    {
+        if (argc < 3)
+        {
+            return enif_make_badarg(env);
+        }
+
+        lua::vm_t * vm = NULL;
+        if(!enif_get_resource(env, argv[0], res_type, reinterpret_cast<void**>(&vm)))
+        {
+            return enif_make_badarg(env);
+        }
+
+        ErlNifPid self;
+        if(!enif_self(env, &self))
+        {
+            return enif_make_badarg(env);
+        }
+
+        if (!enif_is_list(env, argv[2]))
+        {
+            return enif_make_badarg(env);
+        }
+
+        // the call runs right here, so the arguments are read in place
+        boost::shared_ptr<ErlNifEnv> args_env(env, borrow_env);
+        lua::vm_t::tasks::call_t call = make_call(env, vm, argv[1], args_env, argv[2], lpid_t(self));
+
+        return vm->call_sync(call, env);
+    }
+    catch( std::exception & ex )
+    {
+        return enif_make_tuple2(env, atoms.error, enif_make_atom(env, ex.what()));
+    }
+}
+
+// Runs on a dirty CPU scheduler as well, since it needs to hold the VM.
+static ERL_NIF_TERM prepare(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[])
+{
+    try
+    {
+        if (argc < 2)
+        {
+            return enif_make_badarg(env);
+        }
+
+        lua::vm_t * vm = NULL;
+        if(!enif_get_resource(env, argv[0], res_type, reinterpret_cast<void**>(&vm)))
+        {
+            return enif_make_badarg(env);
+        }
+
+        binary_t path = from_erl<binary_t>(env, argv[1]);
+        lua::vm_t::prepared_t * prepared = vm->prepare(std::string(path.begin(), path.end()));
+        if (!prepared)
+        {
+            return enif_make_tuple2(env, atoms.error, atoms.not_a_function);
+        }
+
+        ERL_NIF_TERM handle = enif_make_resource(env, prepared);
+        enif_release_resource(prepared);
+        return enif_make_tuple2(env, atoms.ok, handle);
+    }
+    catch( std::exception & ex )
+    {
+        return enif_make_tuple2(env, atoms.error, enif_make_atom(env, ex.what()));
+    }
+}
+
+static ERL_NIF_TERM queue_len(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[])
+{
+    lua::vm_t * vm = NULL;
+    if(argc < 1 || !enif_get_resource(env, argv[0], res_type, reinterpret_cast<void**>(&vm)))
+    {
+        return enif_make_badarg(env);
+    }
+    return enif_make_uint64(env, vm->queue_len());
+}
+
+static ERL_NIF_TERM stats(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[])
+{
+    lua::vm_t * vm = NULL;
+    if(argc < 1 || !enif_get_resource(env, argv[0], res_type, reinterpret_cast<void**>(&vm)))
+    {
+        return enif_make_badarg(env);
+    }
+
+    lua::vm_t::stats_t stats = vm->stats();
+    ERL_NIF_TERM items[] = {
+        enif_make_tuple2(env, atoms.queue_len,  enif_make_uint64(env, stats.queue_len)),
+        enif_make_tuple2(env, atoms.capacity,   enif_make_uint64(env, stats.capacity)),
+        enif_make_tuple2(env, atoms.high_water, enif_make_uint64(env, stats.high_water)),
+        enif_make_tuple2(env, atoms.overloaded, enif_make_uint64(env, stats.overloaded)),
+        enif_make_tuple2(env, atoms.expired,    enif_make_uint64(env, stats.expired)),
+        enif_make_tuple2(env, atoms.busy_time,  enif_make_uint64(env, stats.busy_time)),
+        enif_make_tuple2(env, atoms.tasks,      enif_make_uint64(env, stats.tasks)),
+        enif_make_tuple2(env, atoms.running,    enif_make_uint64(env, stats.running)),
+        enif_make_tuple2(env, atoms.suspended,  enif_make_uint64(env, stats.suspended))
+    };
+    return enif_make_list_from_array(env, items, sizeof(items) / sizeof(items[0]));
+}
+
 static ERL_NIF_TERM result(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[])
 {
     try
     {
 
-        if (argc < 3) {
+        if (argc < 4) {
             return enif_make_badarg(env);
         }
 
@@ -168,10 +661,16 @@ static ERL_NIF_TERM result(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[])
             return enif_make_badarg(env);
         }
 
-        term_t term = from_erl<term_t>(env, argv[1]);
+        ErlNifUInt64 id = 0;
+        if(!enif_get_uint64(env, argv[3], &id)) {
+            return enif_make_badarg(env);
+        }
+
 		lpid_t caller_pid = from_erl<lpid_t>(env, argv[2]);
 
-        lua::vm_t::tasks::resp_t resp(term, caller_pid);
+        boost::shared_ptr<ErlNifEnv> term_env(enif_alloc_env(), enif_free_env);
+        ERL_NIF_TERM term = enif_make_copy(term_env.get(), argv[1]);
+        lua::vm_t::tasks::resp_t resp(term_env, term, caller_pid, id);
         vm->add_resp_task(lua::vm_t::task_t(resp));
 
         return atoms.ok;
@@ -183,15 +682,49 @@ static ERL_NIF_TERM result(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[])
 }
 
 
+// cancel(VM, Ref): the caller of the request tagged Ref stopped waiting.
+static ERL_NIF_TERM cancel(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[])
+{
+    if (argc < 2) {
+        return enif_make_badarg(env);
+    }
+
+    lua::vm_t * vm = NULL;
+    if(!enif_get_resource(env, argv[0], res_type, reinterpret_cast<void**>(&vm))) {
+        return enif_make_badarg(env);
+    }
+
+    boost::shared_ptr<ErlNifEnv> ref_env(enif_alloc_env(), enif_free_env);
+    ERL_NIF_TERM ref = enif_make_copy(ref_env.get(), argv[1]);
+    vm->enqueue(lua::vm_t::task_t(lua::vm_t::tasks::cancel_t(ref_env, ref)));
+    return atoms.ok;
+}
+
 
 /////////////////////////////////////////////////////////////////////////////
 
 static ErlNifFunc nif_funcs[] = {
     {"start", 1, start},
+    {"start", 2, start},
     {"load", 3, load},
+    {"load", 4, load},
+    {"load", 5, load},
     {"eval", 3, eval},
+    {"eval", 4, eval},
+    {"eval", 5, eval},
+    {"eval", 6, eval},
     {"call", 4, call},
-    {"result", 3, result}
+    {"call", 5, call},
+    {"call", 6, call},
+    {"call_batch", 3, call_batch},
+    {"call_batch", 4, call_batch},
+    {"call_batch", 5, call_batch},
+    {"call_sync", 3, call_sync, ERL_NIF_DIRTY_JOB_CPU_BOUND},
+    {"prepare", 2, prepare, ERL_NIF_DIRTY_JOB_CPU_BOUND},
+    {"queue_len", 1, queue_len},
+    {"stats", 1, stats},
+    {"cancel", 2, cancel},
+    {"result", 4, result}
 };
 
 ERL_NIF_INIT(moon_nif, nif_funcs, &init, NULL, upgrade, unload)
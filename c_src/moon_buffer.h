@@ -0,0 +1,48 @@
+#ifndef MOON_BUFFER_H
+#define MOON_BUFFER_H
+
+#include <lua.h>
+#include <lauxlib.h>
+
+/* moon.buffer: an Erlang binary handed to Lua without being copied into a
+ * Lua string (see the buffer_threshold option). The bytes are read-only and
+ * are not NUL terminated; they stay valid as long as the userdata does. */
+
+#define MOON_BUFFER "moon.buffer"
+
+typedef struct moon_buffer_t
+{
+    const char * data;
+    size_t       size;
+} moon_buffer_t;
+
+/* The buffer at idx, or NULL when it is something else. */
+static inline moon_buffer_t * moon_tobuffer(lua_State * L, int idx)
+{
+    moon_buffer_t * buffer = (moon_buffer_t *)lua_touserdata(L, idx);
+    if (buffer && lua_type(L, idx) == LUA_TUSERDATA && lua_getmetatable(L, idx))
+    {
+        int is_buffer;
+        luaL_getmetatable(L, MOON_BUFFER);
+        is_buffer = lua_rawequal(L, -1, -2);
+        lua_pop(L, 2);
+        if (is_buffer)
+            return buffer;
+    }
+    return NULL;
+}
+
+/* Like luaL_checklstring, but a buffer is accepted as well. */
+static inline const char * moon_checklbuffer(lua_State * L, int idx, size_t * len)
+{
+    moon_buffer_t * buffer = moon_tobuffer(L, idx);
+    if (buffer)
+    {
+        if (len)
+            *len = buffer->size;
+        return buffer->data;
+    }
+    return luaL_checklstring(L, idx, len);
+}
+
+#endif
@@ -7,6 +7,7 @@
 #include <stdint.h>
 
 #include "pbc.h"
+#include "../moon_buffer.h"
 
 #if LUA_VERSION_NUM == 501
 
@@ -63,7 +64,11 @@ _rmessage_new(lua_State *L) {
 	struct pbc_env * env = checkuserdata(L,1);
 	const char * typename = luaL_checkstring(L,2);
 	struct pbc_slice slice;
-	if (lua_isstring(L,3)) {
+	moon_buffer_t * buffer = moon_tobuffer(L,3);
+	if (buffer) {
+		slice.buffer = (void *)buffer->data;
+		slice.len = (int)buffer->size;
+	} else if (lua_isstring(L,3)) {
 		size_t sz = 0;
 		slice.buffer = (void *)lua_tolstring(L,3,&sz);
 		slice.len = (int)sz;
@@ -546,7 +551,11 @@ _pattern_unpack(lua_State *L) {
 	const char * format = lua_tolstring(L,2,&format_sz);
 	int size = lua_tointeger(L,3);
 	struct pbc_slice slice;
-	if (lua_isstring(L,4)) {
+	moon_buffer_t * buffer = moon_tobuffer(L,4);
+	if (buffer) {
+		slice.buffer = (void *)buffer->data;
+		slice.len = buffer->size;
+	} else if (lua_isstring(L,4)) {
 		size_t buffer_len = 0;
 		const char *buffer = luaL_checklstring(L,4,&buffer_len);
 		slice.buffer = (void *)buffer;
@@ -941,7 +950,11 @@ _decode(lua_State *L) {
 	luaL_checktype(L, 3 , LUA_TTABLE);
 	const char * type = luaL_checkstring(L,4);
 	struct pbc_slice slice;
-	if (lua_type(L,5) == LUA_TSTRING) {
+	moon_buffer_t * buffer = moon_tobuffer(L,5);
+	if (buffer) {
+		slice.buffer = (void *)buffer->data;
+		slice.len = (int)buffer->size;
+	} else if (lua_type(L,5) == LUA_TSTRING) {
 		size_t len;
 		slice.buffer = (void *)luaL_checklstring(L,5,&len);
 		slice.len = (int)len;
@@ -1,51 +1,233 @@
 #pragma once
 
-#include <queue>
-#include <boost/thread/mutex.hpp>
-#include <boost/thread/condition_variable.hpp>
+#include <cstddef>
+#include <boost/atomic.hpp>
+#include <boost/optional.hpp>
+#include <boost/noncopyable.hpp>
 
-// TODO: replace the queue with native ErlNifMutex and ErlNifCond
+#include <erl_nif.h>
+
+// Bounded lock-free multi-producer/single-consumer ring (Vyukov's bounded
+// queue, specialised for one consumer). Producers only touch the atomics;
+// the ErlNifMutex/ErlNifCond pair is used solely to park the consumer when
+// the ring is empty (and producers when it is full), so a push only pays for
+// a wakeup when the consumer is actually asleep.
+// Cells only hold a pointer to their element, which is allocated by the
+// push: the ring is sized up front, and an idle VM should not pay for
+// capacity times sizeof(data_t).
 template<typename data_t>
-class queue
+class queue : boost::noncopyable
 {
 private:
-    std::queue<data_t> queue_;
-    mutable boost::mutex mutex_;
-    boost::condition_variable cond_;
+    struct cell_t
+    {
+        boost::atomic<std::size_t> seq;
+        data_t *                   value;
+    };
+
+    struct never_t
+    {
+        bool operator()() const { return false; }
+    };
+
+    static std::size_t round_up(std::size_t capacity)
+    {
+        std::size_t result = 2;
+        while(result < capacity) result <<= 1;
+        return result;
+    }
+
+    cell_t* front()
+    {
+        std::size_t pos = head_.load(boost::memory_order_relaxed);
+        cell_t* cell = &cells_[pos & mask_];
+        std::size_t seq = cell->seq.load(boost::memory_order_acquire);
+        return (seq == pos + 1) ? cell : NULL;
+    }
+
+    void release(cell_t* cell)
+    {
+        std::size_t pos = head_.load(boost::memory_order_relaxed);
+        delete cell->value;
+        cell->value = NULL;
+        head_.store(pos + 1, boost::memory_order_relaxed);
+        cell->seq.store(pos + mask_ + 1, boost::memory_order_release);
+
+        boost::atomic_thread_fence(boost::memory_order_seq_cst);
+        if (producers_waiting_.load(boost::memory_order_relaxed))
+        {
+            enif_mutex_lock(mutex_);
+            enif_cond_broadcast(not_full_);
+            enif_mutex_unlock(mutex_);
+        }
+    }
+
+    bool full() const
+    {
+        std::size_t pos = tail_.load(boost::memory_order_relaxed);
+        cell_t const* cell = &cells_[pos & mask_];
+        std::size_t seq = cell->seq.load(boost::memory_order_acquire);
+        return static_cast<std::ptrdiff_t>(seq) - static_cast<std::ptrdiff_t>(pos) < 0;
+    }
+
+    cell_t*                    cells_;
+    std::size_t                mask_;
+    ErlNifMutex*               mutex_;
+    ErlNifCond*                not_empty_;
+    ErlNifCond*                not_full_;
+    boost::atomic<bool>        consumer_waiting_;
+    boost::atomic<std::size_t> producers_waiting_;
+    char                       pad0_[64];
+    boost::atomic<std::size_t> head_;
+    char                       pad1_[64];
+    boost::atomic<std::size_t> tail_;
+    char                       pad2_[64];
+
 public:
-    void push(data_t const& data)
+    explicit queue(std::size_t capacity = 1024)
+        : cells_(new cell_t[round_up(capacity)])
+        , mask_(round_up(capacity) - 1)
+        , mutex_(enif_mutex_create(const_cast<char*>("moon.queue.mutex")))
+        , not_empty_(enif_cond_create(const_cast<char*>("moon.queue.not_empty")))
+        , not_full_(enif_cond_create(const_cast<char*>("moon.queue.not_full")))
+        , consumer_waiting_(false)
+        , producers_waiting_(0)
+        , head_(0)
+        , tail_(0)
     {
-        boost::mutex::scoped_lock lock(mutex_);
-        queue_.push(data);
-        lock.unlock();
-        cond_.notify_one();
+        for(std::size_t i = 0; i <= mask_; ++i)
+        {
+            cells_[i].seq.store(i, boost::memory_order_relaxed);
+            cells_[i].value = NULL;
+        }
     }
 
-    data_t pop()
+    ~queue()
     {
-        boost::mutex::scoped_lock lock(mutex_);
-        while(queue_.empty())
+        for(cell_t* cell = front(); cell; cell = front())
         {
-            cond_.wait(lock);
+            release(cell);
         }
+        delete [] cells_;
+        enif_cond_destroy(not_full_);
+        enif_cond_destroy(not_empty_);
+        enif_mutex_destroy(mutex_);
+    }
 
-        data_t result = queue_.front();
-        queue_.pop();
-        return result;
+    bool try_push(data_t const& data)
+    {
+        // allocated before a cell is claimed: a claimed cell must be filled
+        data_t* value = new data_t(data);
+        cell_t* cell = NULL;
+        std::size_t pos = tail_.load(boost::memory_order_relaxed);
+        for(;;)
+        {
+            cell = &cells_[pos & mask_];
+            std::size_t seq = cell->seq.load(boost::memory_order_acquire);
+            std::ptrdiff_t dif = static_cast<std::ptrdiff_t>(seq) - static_cast<std::ptrdiff_t>(pos);
+            if (dif == 0)
+            {
+                if (tail_.compare_exchange_weak(pos, pos + 1, boost::memory_order_relaxed)) break;
+            }
+            else if (dif < 0)
+            {
+                delete value;
+                return false;
+            }
+            else
+            {
+                pos = tail_.load(boost::memory_order_relaxed);
+            }
+        }
+
+        cell->value = value;
+        cell->seq.store(pos + 1, boost::memory_order_release);
+
+        boost::atomic_thread_fence(boost::memory_order_seq_cst);
+        if (consumer_waiting_.load(boost::memory_order_relaxed))
+        {
+            enif_mutex_lock(mutex_);
+            enif_cond_signal(not_empty_);
+            enif_mutex_unlock(mutex_);
+        }
+        return true;
     }
 
-    data_t pop_resp()
+    void push(data_t const& data)
     {
-        boost::mutex::scoped_lock lock(mutex_);
-        while(queue_.empty())
+        while(!try_push(data))
         {
-            cond_.wait(lock);
+            enif_mutex_lock(mutex_);
+            producers_waiting_.fetch_add(1);
+            boost::atomic_thread_fence(boost::memory_order_seq_cst);
+            if (full())
+            {
+                enif_cond_wait(not_full_, mutex_);
+            }
+            producers_waiting_.fetch_sub(1);
+            enif_mutex_unlock(mutex_);
         }
+    }
 
-        data_t result = queue_.front();
+    // Consumer side; must only be called from the owning thread. Also
+    // returns once ready() holds, for work the consumer takes from
+    // elsewhere whose producers call notify().
+    template <class ready_t>
+    void wait(ready_t const& ready)
+    {
+        if (front() || ready()) return;
 
-        while(!queue_.empty()) queue_.pop();
+        enif_mutex_lock(mutex_);
+        consumer_waiting_.store(true);
+        boost::atomic_thread_fence(boost::memory_order_seq_cst);
+        while(!front() && !ready())
+        {
+            enif_cond_wait(not_empty_, mutex_);
+        }
+        consumer_waiting_.store(false);
+        enif_mutex_unlock(mutex_);
+    }
+
+    void wait() { wait(never_t()); }
+
+    // Wakes the consumer if it sleeps in wait().
+    void notify()
+    {
+        boost::atomic_thread_fence(boost::memory_order_seq_cst);
+        if (consumer_waiting_.load(boost::memory_order_relaxed))
+        {
+            enif_mutex_lock(mutex_);
+            enif_cond_signal(not_empty_);
+            enif_mutex_unlock(mutex_);
+        }
+    }
+
+    boost::optional<data_t> try_pop()
+    {
+        boost::optional<data_t> result;
+        if (cell_t* cell = front())
+        {
+            result = *cell->value;
+            release(cell);
+        }
+        return result;
+    }
+
+    data_t pop()
+    {
+        wait();
+        cell_t* cell = front();
+        data_t result(*cell->value);
+        release(cell);
         return result;
     }
 
+    std::size_t size() const
+    {
+        std::size_t tail = tail_.load(boost::memory_order_relaxed);
+        std::size_t head = head_.load(boost::memory_order_relaxed);
+        return (tail > head) ? tail - head : 0;
+    }
+
+    std::size_t capacity() const { return mask_ + 1; }
 };
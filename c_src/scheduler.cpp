@@ -0,0 +1,157 @@
+#include "scheduler.hpp"
+#include "lua.hpp"
+
+namespace lua {
+
+/////////////////////////////////////////////////////////////////////////////
+
+scheduler_t::scheduler_t(std::size_t workers)
+    : mutex_(enif_mutex_create(const_cast<char*>("moon.scheduler.mutex")))
+    , cond_(enif_cond_create(const_cast<char*>("moon.scheduler.cond")))
+    , pending_(0)
+    , idle_(0)
+    , next_(0)
+    , stopping_(false)
+{
+    enif_tsd_key_create(const_cast<char*>("moon.scheduler.worker"), &current_);
+
+    if (workers == 0) workers = 1;
+    workers_.reserve(workers);
+    for(std::size_t i = 0; i < workers; ++i)
+    {
+        worker_t * worker = new worker_t();
+        worker->owner = this;
+        worker->index = i;
+        worker->mutex = enif_mutex_create(const_cast<char*>("moon.scheduler.runq"));
+        workers_.push_back(worker);
+    }
+
+    for(std::size_t i = 0; i < workers_.size(); ++i)
+    {
+        workers_[i]->started = enif_thread_create(const_cast<char*>("moon.scheduler.worker"),
+            &workers_[i]->tid, scheduler_t::thread_run, workers_[i], NULL) == 0;
+        if (!workers_[i]->started)
+        {
+            enif_fprintf(stderr, "*** failed to start scheduler worker %d\n", static_cast<int>(i));
+        }
+    }
+}
+
+scheduler_t::~scheduler_t()
+{
+    enif_mutex_lock(mutex_);
+    stopping_.store(true);
+    enif_cond_broadcast(cond_);
+    enif_mutex_unlock(mutex_);
+
+    for(std::size_t i = 0; i < workers_.size(); ++i)
+    {
+        if (workers_[i]->started) enif_thread_join(workers_[i]->tid, NULL);
+        enif_mutex_destroy(workers_[i]->mutex);
+        delete workers_[i];
+    }
+
+    enif_tsd_key_destroy(current_);
+    enif_cond_destroy(cond_);
+    enif_mutex_destroy(mutex_);
+}
+
+void scheduler_t::schedule(vm_t * vm)
+{
+    // Work spawned by a worker stays on that worker (LIFO, cache-warm);
+    // work coming from the BEAM schedulers is spread round-robin.
+    worker_t * self = static_cast<worker_t*>(enif_tsd_get(current_));
+    if (self && self->owner == this)
+    {
+        enif_mutex_lock(self->mutex);
+        self->runq.push_front(vm);
+        enif_mutex_unlock(self->mutex);
+    }
+    else
+    {
+        worker_t * worker = workers_[next_.fetch_add(1, boost::memory_order_relaxed) % workers_.size()];
+        enif_mutex_lock(worker->mutex);
+        worker->runq.push_back(vm);
+        enif_mutex_unlock(worker->mutex);
+    }
+
+    pending_.fetch_add(1);
+    if (idle_.load())
+    {
+        enif_mutex_lock(mutex_);
+        enif_cond_signal(cond_);
+        enif_mutex_unlock(mutex_);
+    }
+}
+
+vm_t * scheduler_t::take(std::size_t index)
+{
+    vm_t * result = NULL;
+
+    worker_t * self = workers_[index];
+    enif_mutex_lock(self->mutex);
+    if (!self->runq.empty())
+    {
+        result = self->runq.front();
+        self->runq.pop_front();
+    }
+    enif_mutex_unlock(self->mutex);
+
+    // steal from the cold end of the other run queues
+    for(std::size_t i = 1; !result && i < workers_.size(); ++i)
+    {
+        worker_t * victim = workers_[(index + i) % workers_.size()];
+        enif_mutex_lock(victim->mutex);
+        if (!victim->runq.empty())
+        {
+            result = victim->runq.back();
+            victim->runq.pop_back();
+        }
+        enif_mutex_unlock(victim->mutex);
+    }
+
+    if (result) pending_.fetch_sub(1);
+    return result;
+}
+
+bool scheduler_t::park()
+{
+    enif_mutex_lock(mutex_);
+    idle_.fetch_add(1);
+    while(!pending_.load() && !stopping_.load())
+    {
+        enif_cond_wait(cond_, mutex_);
+    }
+    idle_.fetch_sub(1);
+    bool running = !stopping_.load();
+    enif_mutex_unlock(mutex_);
+    return running;
+}
+
+void scheduler_t::run(worker_t & worker)
+{
+    enif_tsd_set(current_, &worker);
+    for(;;)
+    {
+        if (vm_t * vm = take(worker.index))
+        {
+            vm->run_slice();
+        }
+        else if (!park())
+        {
+            break;
+        }
+    }
+    enif_tsd_set(current_, NULL);
+}
+
+void* scheduler_t::thread_run(void * worker)
+{
+    worker_t * self = static_cast<worker_t*>(worker);
+    self->owner->run(*self);
+    return 0;
+}
+
+/////////////////////////////////////////////////////////////////////////////
+
+}
@@ -0,0 +1,61 @@
+#pragma once
+
+#include <deque>
+#include <vector>
+#include <boost/atomic.hpp>
+#include <boost/noncopyable.hpp>
+
+#include <erl_nif.h>
+
+namespace lua {
+
+class vm_t;
+
+/////////////////////////////////////////////////////////////////////////////
+
+// Fixed pool of worker threads shared by all pooled VMs. A VM is scheduled
+// onto a worker when its task queue becomes non-empty; each worker serves
+// its own run queue first and steals from the others when it runs dry.
+// A VM waiting for the reply to a blocking erlang.call holds its worker
+// meanwhile, so as many such waits as there are workers stall the pool.
+class scheduler_t : boost::noncopyable
+{
+public :
+    explicit scheduler_t(std::size_t workers);
+    ~scheduler_t();
+
+    // Queues vm to be run by one of the workers; safe from any thread.
+    void schedule(vm_t * vm);
+
+    std::size_t size() const { return workers_.size(); }
+
+private :
+    struct worker_t
+    {
+        scheduler_t *       owner;
+        std::size_t         index;
+        ErlNifTid           tid;
+        bool                started;
+        ErlNifMutex *       mutex;
+        std::deque<vm_t*>   runq;
+    };
+
+    vm_t * take(std::size_t index);
+    bool park();
+    void run(worker_t & worker);
+
+    static void* thread_run(void * worker);
+
+    std::vector<worker_t*>     workers_;
+    ErlNifTSDKey               current_;
+    ErlNifMutex *              mutex_;
+    ErlNifCond *               cond_;
+    boost::atomic<std::size_t> pending_;
+    boost::atomic<std::size_t> idle_;
+    boost::atomic<std::size_t> next_;
+    boost::atomic<bool>        stopping_;
+};
+
+/////////////////////////////////////////////////////////////////////////////
+
+}
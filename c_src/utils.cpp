@@ -41,19 +41,14 @@ lpid_t from_erl<lpid_t>(ErlNifEnv* env, ERL_NIF_TERM term)
 template <>
 atom_t from_erl<atom_t>(ErlNifEnv* env, ERL_NIF_TERM term)
 {
-    unsigned int length = 0;
-    if (!enif_get_atom_length(env, term, &length, ERL_NIF_LATIN1)) {
+    // atoms are at most 255 characters: no need to ask for the length first
+    char buf[256];
+    int sz = enif_get_atom(env, term, buf, sizeof(buf), ERL_NIF_LATIN1);
+    if (sz <= 0) {
         throw errors::invalid_type("invalid_atom");
     }
 
-    std::vector<char> buf(length+1, 0);
-    std::size_t sz = enif_get_atom(env, term, buf.data(), buf.size(), ERL_NIF_LATIN1);
-    if (sz != buf.size()) {
-        throw errors::invalid_type("invalid_atom");
-    }
-
-    std::string result(buf.data());
-    return atom_t(result);
+    return atom_t(atom_t::data_t(buf, sz - 1));
 }
 
 template <>
@@ -107,6 +102,24 @@ tuple_t from_erl<tuple_t>(ErlNifEnv* env, ERL_NIF_TERM term)
     return result;
 }
 
+// term_t has no map type: a map becomes the list of its {Key, Value}
+// pairs, which is what a Lua hash table is pushed from.
+static list_t from_erl_map(ErlNifEnv* env, ERL_NIF_TERM term)
+{
+    list_t result;
+    map_iterator_t iter(env, term);
+    ERL_NIF_TERM key, value;
+    while(iter.next(key, value))
+    {
+        tuple_t pair;
+        pair.reserve(2);
+        pair.push_back( from_erl<term_t>(env, key) );
+        pair.push_back( from_erl<term_t>(env, value) );
+        result.push_back(pair);
+    }
+    return result;
+}
+
 template <>
 term_t from_erl<term_t>(ErlNifEnv* env, ERL_NIF_TERM term)
 {
@@ -134,6 +147,10 @@ term_t from_erl<term_t>(ErlNifEnv* env, ERL_NIF_TERM term)
     {
         return term_t(from_erl<tuple_t>(env, term));
     }
+    else if (enif_is_map(env, term))
+    {
+        return term_t(from_erl_map(env, term));
+    }
     throw errors::unsupported_type();
 }
 
@@ -178,7 +195,7 @@ ERL_NIF_TERM to_erl(ErlNifEnv* env, lpid_t const& value)
 }
 ERL_NIF_TERM to_erl(ErlNifEnv* env, atom_t const& value)
 {
-    return enif_make_atom(env, value.c_str());
+    return enif_make_atom_len(env, value.data(), value.size());
 }
 ERL_NIF_TERM to_erl(ErlNifEnv* env, binary_t const& value)
 {
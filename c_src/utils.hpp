@@ -1,6 +1,7 @@
 #pragma once
 
 #include "types.hpp"
+#include "errors.hpp"
 
 /////////////////////////////////////////////////////////////////////////////
 
@@ -34,4 +35,36 @@ ERL_NIF_TERM to_erl(ErlNifEnv* env, term_t const& value);
 
 /////////////////////////////////////////////////////////////////////////////
 
+// Walks the pairs of a map, destroying the iterator on every way out.
+class map_iterator_t
+{
+public :
+    map_iterator_t(ErlNifEnv* env, ERL_NIF_TERM map) : env_(env)
+    {
+        if (!enif_map_iterator_create(env, map, &iter_, ERL_NIF_MAP_ITERATOR_FIRST)) {
+            throw errors::invalid_type("invalid_map");
+        }
+    }
+    ~map_iterator_t() { enif_map_iterator_destroy(env_, &iter_); }
+
+    // Fetches the next pair; false once the map is exhausted.
+    bool next(ERL_NIF_TERM & key, ERL_NIF_TERM & value)
+    {
+        if (!enif_map_iterator_get_pair(env_, &iter_, &key, &value)) {
+            return false;
+        }
+        enif_map_iterator_next(env_, &iter_);
+        return true;
+    }
+
+private :
+    map_iterator_t(map_iterator_t const&);
+    map_iterator_t& operator=(map_iterator_t const&);
+
+    ErlNifEnv *       env_;
+    ErlNifMapIterator iter_;
+};
+
+/////////////////////////////////////////////////////////////////////////////
+
 }
@@ -2,10 +2,20 @@
 
 -export([start/0, stop/0]).
 -export([start_vm/0, start_vm/1, stop_vm/1]).
+-export([add_template/2, remove_template/1, checkout_vm/1]).
+-export([start_pool/3, stop_pool/1]).
 
 -export([load/2, load/3]).
--export([eval/2, eval/3]).
+-export([eval/2, eval/3, eval/4]).
 -export([call/3, call/4]).
+-export([call_async/3, call_async/4, await/2]).
+-export([call_keyed/4, call_keyed/5]).
+-export([eval_all/2, eval_all/3]).
+-export([call_batch/2, call_batch/3]).
+-export([call_sync/3]).
+-export([prepare/2]).
+-export([queue_len/1, stats/1]).
+-export([set_tenant/1, set_tenant/2]).
 
 -export([test/1]).
 
@@ -46,6 +56,30 @@ start_vm(Options) ->
 stop_vm(Pid) ->
     moon_sup:stop_child(Pid).
 
+%% Keeps Size VMs started with Options and loaded with the files and chunks
+%% of Spec ([{size, Size}, {options, Options}, {load, [File]}, {eval, [Code]}])
+%% ready for checkout_vm/1. Templates can also be set in the moon env as
+%% {templates, [{Name, Spec}]}.
+add_template(Name, Spec) ->
+    moon_warm:add_template(Name, Spec).
+
+remove_template(Name) ->
+    moon_warm:remove_template(Name).
+
+%% {ok, Pid} of a ready VM of template Name, which is refilled in the
+%% background; the VM belongs to the caller, who stops it with stop_vm/1.
+checkout_vm(Name) ->
+    moon_warm:checkout(Name).
+
+%% Size VMs started with Options (plus {load, [File]} and {eval, [Code]}
+%% run on each) that call/call_keyed/eval_all accept Name for; dead VMs
+%% are replaced.
+start_pool(Name, Size, Options) ->
+    moon_pool:start_pool(Name, Size, Options).
+
+stop_pool(Name) ->
+    moon_pool:stop_pool(Name).
+
 %%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%
 
 load(Pid, File) ->
@@ -59,16 +93,114 @@ load(Pid, File, Timeout) ->
 eval(Pid, Code) ->
     eval(Pid, Code, infinity).
 
+%% eval(Pid, Code, Bindings) runs Code with the names of Bindings (a map
+%% or a [{Name, Value}] list) set as globals of that chunk only. Keep the
+%% code fixed and pass what varies as bindings: compiled chunks are cached
+%% by their text.
+eval(Pid, Code, Bindings) when is_map(Bindings); is_list(Bindings) ->
+    eval(Pid, Code, Bindings, infinity);
 eval(Pid, Code, Timeout) ->
     moon_vm:eval(Pid, Code, Timeout).
 
+eval(Pid, Code, Bindings, Timeout) ->
+    moon_vm:eval(Pid, Code, Bindings, Timeout).
+
 %%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%
 
 call(Pid, Fun, Args) ->
     call(Pid, Fun, Args, infinity).
 
-call(Pid, Fun, Args, Timeout) ->
-    moon_vm:call(Pid, Fun, Args, Timeout).
+%% Pid may also name a pool, whose VM with the shortest queue runs the call.
+%% (A prepared function belongs to one VM and cannot be used that way.)
+call(Pid, Fun, Args, Timeout) when is_pid(Pid) ->
+    moon_vm:call(Pid, Fun, Args, Timeout);
+call(Name, Fun, Args, Timeout) ->
+    case moon_pool:pick(Name) of
+        {ok, Pid} -> moon_vm:call(Pid, Fun, Args, Timeout);
+        undefined -> moon_vm:call(Name, Fun, Args, Timeout); % a registered VM
+        Error -> Error
+    end.
+
+%% Ref of a call left running; await(Ref, Timeout) returns what call/4
+%% would. One process can keep many calls in flight this way, on one VM or
+%% many, and do its own work in between. Pid may name a pool as for call/4.
+call_async(Pid, Fun, Args) ->
+    call_async(Pid, Fun, Args, infinity).
+
+call_async(Pid, Fun, Args, Timeout) when is_pid(Pid) ->
+    moon_vm:call_async(Pid, Fun, Args, Timeout);
+call_async(Name, Fun, Args, Timeout) ->
+    case moon_pool:pick(Name) of
+        {ok, Pid} -> moon_vm:call_async(Pid, Fun, Args, Timeout);
+        undefined -> moon_vm:call_async(Name, Fun, Args, Timeout);
+        Error -> Ref = make_ref(), self() ! {moon_response, Ref, Error}, Ref
+    end.
+
+%% {error, timeout} if the reply is not there within Timeout; the call
+%% keeps running and Ref can be awaited again.
+await(Ref, Timeout) ->
+    moon_vm:await(Ref, Timeout).
+
+%% Calls with the same Key go to the same VM of pool Name (by consistent
+%% hashing), for state kept in the VMs.
+call_keyed(Name, Key, Fun, Args) ->
+    call_keyed(Name, Key, Fun, Args, infinity).
+
+call_keyed(Name, Key, Fun, Args, Timeout) ->
+    case moon_pool:pick(Name, Key) of
+        {ok, Pid} -> moon_vm:call(Pid, Fun, Args, Timeout);
+        undefined -> {error, not_found};
+        Error -> Error
+    end.
+
+%% Code evaluated on every VM of pool Name in parallel:
+%% {ok, [Result]}, one result per VM.
+eval_all(Name, Code) ->
+    eval_all(Name, Code, infinity).
+
+eval_all(Name, Code, Timeout) ->
+    moon_pool:eval_all(Name, Code, Timeout).
+
+%% Runs every {Fun, Args} back-to-back on the VM thread; the reply is
+%% {ok, [{ok, Result} | {error_lua, Reason}]}, in the order of Calls.
+call_batch(Pid, Calls) ->
+    call_batch(Pid, Calls, infinity).
+
+call_batch(Pid, Calls, Timeout) ->
+    moon_vm:call_batch(Pid, Calls, Timeout).
+
+call_sync(Pid, Fun, Args) ->
+    moon_vm:call_sync(Pid, Fun, Args).
+
+%% {ok, Fun} for the function at FunPath ("fn" or "mod.sub.fn"), to be
+%% passed to call/call_batch/call_sync in place of a name; the lookup is
+%% done once here. {error, not_a_function} if there is none.
+prepare(Pid, FunPath) ->
+    moon_vm:prepare(Pid, FunPath).
+
+%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%
+
+%% Number of tasks waiting in the VM queue.
+queue_len(Pid) ->
+    moon_vm:queue_len(Pid).
+
+%% [{queue_len, N}, {capacity, N}, {high_water, N}, {overloaded, N}, {expired, N},
+%%  {busy_time, Microseconds}, {tasks, N}, {running, N}, {suspended, N}]
+stats(Pid) ->
+    moon_vm:stats(Pid).
+
+%% Requests made by the calling process from now on are accounted to
+%% Tenant (instead of to the process itself) by VMs started with
+%% {fair_queuing, true}; a tenant with Weight 2 gets twice the share.
+set_tenant(Tenant) ->
+    set_tenant(Tenant, 1).
+
+set_tenant(undefined, _) ->
+    erase(moon_tenant),
+    ok;
+set_tenant(Tenant, Weight) when is_integer(Weight), Weight > 0 ->
+    put(moon_tenant, {Tenant, Weight}),
+    ok.
 
 %%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%
 
@@ -1,6 +1,8 @@
 -module(moon_nif).
 
--export([start/1, load/3, eval/3, call/4, result/3]).
+-export([start/1, start/2, load/3, load/4, load/5, eval/3, eval/4, eval/5, eval/6]).
+-export([call/4, call/5, call/6, call_batch/3, call_batch/4, call_batch/5]).
+-export([call_sync/3, prepare/2, queue_len/1, stats/1, result/4, cancel/2]).
 -on_load(init/0).
 
 %%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%
@@ -8,16 +10,64 @@
 start(_) ->
     exit(nif_library_not_loaded).
 
+start(_, _) ->
+    exit(nif_library_not_loaded).
+
 load(_, _, _) ->
     exit(nif_library_not_loaded).
 
+load(_, _, _, _) ->
+    exit(nif_library_not_loaded).
+
+load(_, _, _, _, _) ->
+    exit(nif_library_not_loaded).
+
 eval(_, _, _) ->
     exit(nif_library_not_loaded).
 
+eval(_, _, _, _) ->
+    exit(nif_library_not_loaded).
+
+eval(_, _, _, _, _) ->
+    exit(nif_library_not_loaded).
+
+eval(_, _, _, _, _, _) ->
+    exit(nif_library_not_loaded).
+
 call(_, _, _, _) ->
     exit(nif_library_not_loaded).
 
-result(_, _, _) ->
+call(_, _, _, _, _) ->
+    exit(nif_library_not_loaded).
+
+call(_, _, _, _, _, _) ->
+    exit(nif_library_not_loaded).
+
+call_batch(_, _, _) ->
+    exit(nif_library_not_loaded).
+
+call_batch(_, _, _, _) ->
+    exit(nif_library_not_loaded).
+
+call_batch(_, _, _, _, _) ->
+    exit(nif_library_not_loaded).
+
+call_sync(_, _, _) ->
+    exit(nif_library_not_loaded).
+
+prepare(_, _) ->
+    exit(nif_library_not_loaded).
+
+queue_len(_) ->
+    exit(nif_library_not_loaded).
+
+stats(_) ->
+    exit(nif_library_not_loaded).
+
+result(_, _, _, _) ->
+    exit(nif_library_not_loaded).
+
+cancel(_, _) ->
     exit(nif_library_not_loaded).
 
 %%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%
@@ -27,12 +77,18 @@ init() ->
     case erlang:system_info(smp_support) of
         true ->
             SoName = filename:join(priv_dir(), ?MODULE),
-            ok = erlang:load_nif(filename:absname(SoName), 0);
+            ok = erlang:load_nif(filename:absname(SoName), load_info());
         false ->
             error(no_smp_support)
      end.
 %%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%
 
+%% Settings of the compiled-chunk cache shared by all VMs, from the moon
+%% application env.
+load_info() ->
+    [{Key, Value} || Key <- [chunk_cache_dir, chunk_cache_size],
+                     {ok, Value} <- [application:get_env(moon, Key)]].
+
 priv_dir() ->
     case code:priv_dir(gl_wrapper_lua) of
         PrivDir when is_list(PrivDir) ->
@@ -0,0 +1,317 @@
+-module(moon_pool).
+-behaviour(gen_server).
+
+%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%
+%% A named set of VMs. The members are published in the moon_pools table,
+%% so callers pick a VM themselves (pick/1, pick/2) without going through
+%% the pool server, which only starts VMs and replaces those that die and,
+%% with {autoscale, ...}, resizes the pool to the load it measures.
+
+%% gen_server callbacks:
+-export([init/1, handle_call/3, handle_cast/2, handle_info/2, terminate/2, code_change/3]).
+
+%% api:
+-export([start_link/3, start_pool/3, stop_pool/1]).
+-export([pick/1, pick/2, members/1, eval_all/3]).
+
+%% slots: Id => {Pid, Handle, Monitor}; a VM replacing a dead one keeps its
+%% slot, and with it its keys on the hash ring
+%% building: Id => true for the slots whose VM is being started
+%% draining: Pid => {Handle, Monitor, Deadline} for VMs taken out of the pool
+-record(state, {name, spec, slots = #{}, next = 1, building = #{}, draining = #{}, scale, busy = #{}}).
+
+%% {autoscale, [{min, N}, {max, N}, {interval, Ms}, {target, Utilization},
+%%              {max_queue, N}, {drain_timeout, Ms}]}
+-record(scale, {min, max, interval, target, max_queue, drain_timeout}).
+
+-define(TABLE, moon_pools).
+-define(POINTS, 64). % ring points per VM
+-define(RETRY_AFTER, 1000).
+-define(DRAIN_POLL, 100).
+
+%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%
+%% Public api:
+
+start_link(Name, Size, Options) ->
+    gen_server:start_link(?MODULE, {Name, Size, Options}, []).
+
+%% Options are those of moon:start_vm/1, plus {load, [File]} and
+%% {eval, [Code]} run on every VM before it takes requests, and
+%% {autoscale, Bounds} to let the pool grow and shrink (see scale/1).
+start_pool(Name, Size, Options) when is_integer(Size), Size > 0, is_list(Options) ->
+    case moon_pool_sup:start_child([Name, Size, Options]) of
+        {error, {already_started, _}} -> {error, already_started};
+        Result -> Result
+    end.
+
+stop_pool(Name) ->
+    case ets:lookup(?TABLE, Name) of
+        [{_, Pool, _, _}] -> moon_pool_sup:stop_child(Pool);
+        [] -> {error, not_found}
+    end.
+
+%% The member with the shortest queue; undefined if there is no such pool.
+pick(Name) ->
+    case ets:lookup(?TABLE, Name) of
+        [{_, _, {}, _}] -> {error, no_vm};
+        [{_, _, Members, _}] -> {ok, least_loaded(Members)};
+        [] -> undefined
+    end.
+
+%% The member owning Key on the hash ring, the same one for as long as the
+%% pool keeps its size.
+pick(Name, Key) ->
+    case ets:lookup(?TABLE, Name) of
+        [{_, _, _, {}}] -> {error, no_vm};
+        [{_, _, _, Ring}] -> {ok, element(2, element(lookup(Ring, erlang:phash2(Key, 1 bsl 32)), Ring))};
+        [] -> undefined
+    end.
+
+members(Name) ->
+    case ets:lookup(?TABLE, Name) of
+        [{_, _, Members, _}] -> {ok, [Pid || {Pid, _} <- tuple_to_list(Members)]};
+        [] -> undefined
+    end.
+
+%% Code evaluated on every member at once; the results come in member order.
+eval_all(Name, Code, Timeout) ->
+    case members(Name) of
+        {ok, Pids} -> {ok, pmap(fun(Pid) -> moon:eval(Pid, Code, Timeout) end, Pids)};
+        undefined -> {error, not_found}
+    end.
+
+%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%
+
+init({Name, Size, Options}) ->
+    process_flag(trap_exit, true),
+    case ets:insert_new(?TABLE, {Name, self(), {}, {}}) of
+        true ->
+            Spec = [{options, Options},
+                    {load, proplists:get_value(load, Options, [])},
+                    {eval, proplists:get_value(eval, Options, [])}],
+            Scale = scale(proplists:get_value(autoscale, Options)),
+            Ids = lists:seq(1, bound(Size, Scale)),
+            Built = pmap(fun(_) -> moon_warm:build(Spec) end, Ids),
+            State = lists:foldl(fun({Id, {ok, Pid}}, S) -> add(Id, Pid, S); (_, S) -> S end,
+                                #state{name=Name, spec=Spec, next=length(Ids) + 1, scale=Scale},
+                                lists:zip(Ids, Built)),
+            case [Error || Error={error, _} <- Built] of
+                [] ->
+                    tick(State),
+                    {ok, publish(State)};
+                [{error, Reason} | _] ->
+                    terminate(Reason, State),
+                    {stop, Reason}
+            end;
+        false ->
+            {stop, {already_started, Name}}
+    end.
+
+handle_call(_, _, State) ->
+    {reply, {error, no_right_param}, State}.
+
+handle_cast(_, State) ->
+    {noreply, State}.
+
+handle_info({'DOWN', Monitor, process, Pid, _}, State=#state{slots=Slots, draining=Draining}) ->
+    case [Id || {Id, {_, _, M}} <- maps:to_list(Slots), M =:= Monitor] of
+        [Id] ->
+            {noreply, publish(rebuild(Id, State#state{slots=maps:remove(Id, Slots)}))};
+        [] ->
+            {noreply, State#state{draining=maps:remove(Pid, Draining)}}
+    end;
+
+handle_info({built, Id, {ok, Pid}}, State=#state{building=Building}) ->
+    {noreply, publish(add(Id, Pid, State#state{building=maps:remove(Id, Building)}))};
+
+handle_info({built, Id, {error, Reason}}, State=#state{name=Name}) ->
+    error_logger:error_msg("moon: cannot restart a VM of pool ~p: ~p~n", [Name, Reason]),
+    erlang:send_after(?RETRY_AFTER, self(), {rebuild, Id}),
+    {noreply, State};
+
+handle_info({rebuild, Id}, State) ->
+    {noreply, rebuild(Id, State)};
+
+handle_info(scale, State) ->
+    tick(State),
+    {noreply, autoscale(State)};
+
+handle_info(drain, State) ->
+    {noreply, drain(State)};
+
+handle_info(_, State) ->
+    {noreply, State}.
+
+terminate(_, #state{name=Name, slots=Slots, draining=Draining}) ->
+    ets:delete(?TABLE, Name),
+    [moon_sup:stop_child(Pid) || {Pid, _, _} <- maps:values(Slots)],
+    [moon_sup:stop_child(Pid) || Pid <- maps:keys(Draining)],
+    ok.
+
+code_change(_, State, _) ->
+    {ok, State}.
+
+%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%
+
+%% A VM that died since it was built is replaced like a dead member; one
+%% that dies after the lookup is caught by its monitor.
+add(Id, Pid, State=#state{slots=Slots}) ->
+    case vm_handle(Pid) of
+        {ok, Handle} ->
+            State#state{slots=Slots#{Id => {Pid, Handle, erlang:monitor(process, Pid)}}};
+        error ->
+            rebuild(Id, State)
+    end.
+
+vm_handle(Pid) ->
+    case ets:lookup(moon_vms, Pid) of
+        [{_, Handle}] ->
+            {ok, Handle};
+        [] ->
+            try gen_server:call(Pid, handle)
+            catch exit:_ -> error
+            end
+    end.
+
+rebuild(Id, State=#state{spec=Spec, building=Building}) ->
+    Self = self(),
+    spawn(fun() -> Self ! {built, Id, moon_warm:build(Spec)} end),
+    State#state{building=Building#{Id => true}}.
+
+%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%
+%% autoscaling:
+
+%% Every interval the pool is sized so that its VMs are busy about target
+%% of the time (busy_time from moon:stats/1), and have at most max_queue
+%% tasks waiting each, within [min, max].
+scale(undefined) ->
+    undefined;
+scale(Bounds) ->
+    Min = max(1, proplists:get_value(min, Bounds, 1)),
+    #scale{min = Min,
+           max = max(Min, proplists:get_value(max, Bounds, erlang:system_info(schedulers))),
+           interval = proplists:get_value(interval, Bounds, 1000),
+           target = proplists:get_value(target, Bounds, 0.6),
+           max_queue = proplists:get_value(max_queue, Bounds, 4),
+           drain_timeout = proplists:get_value(drain_timeout, Bounds, 30000)}.
+
+bound(Size, undefined) ->
+    Size;
+bound(Size, #scale{min=Min, max=Max}) ->
+    min(Max, max(Min, Size)).
+
+tick(#state{scale=undefined}) ->
+    ok;
+tick(#state{scale=#scale{interval=Interval}}) ->
+    erlang:send_after(Interval, self(), scale).
+
+autoscale(State=#state{slots=Slots, building=Building, busy=Last, scale=Scale}) ->
+    #scale{interval=Interval, target=Target, max_queue=MaxQueue} = Scale,
+    Stats = [{Id, moon_nif:stats(Handle)} || {Id, {_, Handle, _}} <- maps:to_list(Slots)],
+    Busy = maps:from_list([{Id, proplists:get_value(busy_time, S)} || {Id, S} <- Stats]),
+    % a VM that replaced a dead one starts counting from 0 again
+    Used = lists:sum([max(0, B - maps:get(Id, Last, B)) || {Id, B} <- maps:to_list(Busy)]),
+    Queued = lists:sum([proplists:get_value(queue_len, S) || {_, S} <- Stats]),
+    Wanted = bound(max(ceil(Used / (Interval * 1000 * Target)), ceil(Queued / MaxQueue)), Scale),
+    Size = map_size(Slots),
+    State1 = State#state{busy=Busy},
+    if
+        Wanted > Size + map_size(Building) ->
+            grow(Wanted - Size - map_size(Building), State1);
+        Wanted < Size, map_size(Building) =:= 0 ->
+            shrink(State1); % one at a time, to not overshoot
+        true ->
+            State1
+    end.
+
+grow(0, State) ->
+    State;
+grow(N, State=#state{next=Id}) ->
+    grow(N - 1, rebuild(Id, State#state{next=Id + 1})).
+
+%% The newest VM leaves the pool at once, so no new requests reach it, and
+%% is stopped once the requests it already has are served.
+shrink(State=#state{slots=Slots, draining=Draining, scale=#scale{drain_timeout=Timeout}}) ->
+    Id = lists:max(maps:keys(Slots)),
+    {Pid, Handle, Monitor} = maps:get(Id, Slots),
+    case map_size(Draining) of
+        0 -> erlang:send_after(?DRAIN_POLL, self(), drain);
+        _ -> ok
+    end,
+    Deadline = erlang:monotonic_time(millisecond) + Timeout,
+    publish(State#state{slots=maps:remove(Id, Slots), draining=Draining#{Pid => {Handle, Monitor, Deadline}}}).
+
+drain(State=#state{draining=Draining}) ->
+    Now = erlang:monotonic_time(millisecond),
+    Done = [Pid || {Pid, {Handle, _, Deadline}} <- maps:to_list(Draining),
+                   idle(Handle) orelse Now >= Deadline],
+    [begin
+         {_, Monitor, _} = maps:get(Pid, Draining),
+         erlang:demonitor(Monitor, [flush]),
+         moon_sup:stop_child(Pid)
+     end || Pid <- Done],
+    Draining1 = maps:without(Done, Draining),
+    case map_size(Draining1) of
+        0 -> ok;
+        _ -> erlang:send_after(?DRAIN_POLL, self(), drain)
+    end,
+    State#state{draining=Draining1}.
+
+%% Nothing queued, nothing running and no coroutine waiting on a callback.
+idle(Handle) ->
+    Stats = moon_nif:stats(Handle),
+    lists:all(fun(Key) -> proplists:get_value(Key, Stats) =:= 0 end, [queue_len, running, suspended]).
+
+%% Members are {Pid, Handle} in slot order; the ring holds ?POINTS
+%% {Point, Pid} entries per member, sorted by point.
+publish(State=#state{name=Name, slots=Slots}) ->
+    Sorted = lists:sort(maps:to_list(Slots)),
+    Members = list_to_tuple([{Pid, Handle} || {_, {Pid, Handle, _}} <- Sorted]),
+    Ring = list_to_tuple(lists:sort([{erlang:phash2({Id, N}, 1 bsl 32), Pid}
+                                     || {Id, {Pid, _, _}} <- Sorted, N <- lists:seq(1, ?POINTS)])),
+    ets:insert(?TABLE, {Name, self(), Members, Ring}),
+    State.
+
+%% Ties are broken from a random start, so that idle members share the load.
+least_loaded(Members) ->
+    Size = tuple_size(Members),
+    Start = rand:uniform(Size),
+    {Pid, Handle} = element(Start, Members),
+    least_loaded(Members, Size, Start, 1, Pid, moon_nif:queue_len(Handle)).
+
+least_loaded(_, Size, _, Size, Best, _) ->
+    Best;
+least_loaded(_, _, _, _, Best, 0) ->
+    Best;
+least_loaded(Members, Size, Start, N, Best, BestLen) ->
+    {Pid, Handle} = element((Start + N - 1) rem Size + 1, Members),
+    case moon_nif:queue_len(Handle) of
+        Len when Len < BestLen -> least_loaded(Members, Size, Start, N + 1, Pid, Len);
+        _ -> least_loaded(Members, Size, Start, N + 1, Best, BestLen)
+    end.
+
+%% Index of the first point at or after Hash, wrapping around.
+lookup(Ring, Hash) ->
+    lookup(Ring, Hash, 1, tuple_size(Ring) + 1).
+
+lookup(Ring, _, Low, High) when Low =:= High ->
+    case Low > tuple_size(Ring) of
+        true -> 1;
+        false -> Low
+    end;
+lookup(Ring, Hash, Low, High) ->
+    Mid = (Low + High) div 2,
+    case element(1, element(Mid, Ring)) < Hash of
+        true -> lookup(Ring, Hash, Mid + 1, High);
+        false -> lookup(Ring, Hash, Low, Mid)
+    end.
+
+%% Runs Fun on every element in parallel, results in the order of List.
+pmap(Fun, List) ->
+    Self = self(),
+    Refs = [begin
+                Ref = make_ref(),
+                spawn(fun() -> Self ! {Ref, catch Fun(X)} end),
+                Ref
+            end || X <- List],
+    [receive {Ref, Result} -> Result end || Ref <- Refs].
@@ -0,0 +1,31 @@
+-module(moon_pool_sup).
+-behaviour(supervisor).
+
+%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%
+
+-export([start_link/0, start_child/1, stop_child/1, init/1]).
+
+%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%
+
+start_link() ->
+    supervisor:start_link({local, ?MODULE}, ?MODULE, []).
+
+start_child(Args) ->
+    supervisor:start_child(?MODULE, Args).
+
+stop_child(Pid) ->
+    supervisor:terminate_child(?MODULE, Pid).
+
+%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%
+
+init([]) ->
+
+    %% Name -> {Name, Pool, Members, Ring}, read by the callers routing to a
+    %% pool; owned by this supervisor so that it outlives the pools
+    ets:new(moon_pools, [named_table, public, set, {read_concurrency, true}]),
+
+    {ok, { {simple_one_for_one, 5, 10}, [
+        {moon_pool, {moon_pool, start_link, []}, temporary, 60000, worker, [moon_pool]}
+    ]} }.
+
+%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%
@@ -16,21 +16,21 @@
 start_link() ->
     supervisor:start_link({local, ?MODULE}, ?MODULE, []).
 
+%% VMs live under moon_vm_sup; these are kept for the callers of moon_sup.
 start_child(Options) ->
-    supervisor:start_child(?MODULE, Options).
+    moon_vm_sup:start_child(Options).
 
 stop_child(Pid) ->
-    supervisor:terminate_child(?MODULE, Pid).
+    moon_vm_sup:stop_child(Pid).
 
 %%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%
 
 init([]) ->
-
-    %% To get an error immideately, if there some troubles with nif
-    code:ensure_loaded(moon_nif),
-
-    {ok, { {simple_one_for_one, 5, 10}, [
-        {moon_vm, {moon_vm, start_link, []}, temporary, 60000, worker, [moon_vm]}
+    {ok, { {one_for_one, 5, 10}, [
+        ?CHILD(moon_vms),
+        ?CHILD(moon_vm_sup, [], supervisor),
+        ?CHILD(moon_warm),
+        ?CHILD(moon_pool_sup, [], supervisor)
     ]} }.
 
 %%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%
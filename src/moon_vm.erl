@@ -8,94 +8,151 @@
 
 %% api:
 -export([start_link/1]).
--export([load/3, eval/3, call/4]).
+-export([load/3, eval/3, eval/4, call/4, call_batch/3, call_sync/3]).
+-export([call_async/4, await/2]).
+-export([prepare/2]).
+-export([queue_len/1, stats/1]).
+
+%% registry: monitor of moon_vms, which loses the table when it restarts
+-record(state, {vm, registry}).
+
+-define(TABLE, moon_vms).
+-define(REPUBLISH_AFTER, 100).
 
--record(state, {vm, callback}).
 %%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%
 %% Public api:
 
 start_link(Options) ->
     gen_server:start_link(?MODULE, Options, []).
 
+%% Timeout covers the whole request: a task still queued when it runs out
+%% is dropped by the VM unrun, and the caller gets {error, timeout}.
+%% Requests go straight to the NIF from the calling process; the moon_vm
+%% process only owns the VM. Each one carries a fresh ref that its
+%% moon_response is tagged with.
 load(Pid, File, Timeout) ->
-	Result = gen_server:call(Pid, {load, File, self()}, Timeout),
-	case Result of
-		{ok, VM} ->
-			receive_response_call(Pid, #state{vm=VM, callback=undefined});
-		_ ->
-			Result
+	Deadline = deadline(Timeout),
+	Ref = make_ref(),
+	VM = vm_handle(Pid),
+	try moon_nif:load(VM, to_binary(File), {self(), Ref}, remaining(Deadline), flow(get(moon_tenant))) of
+		Result -> submitted(Result, VM, Ref, Deadline)
+	catch
+		_:Error ->
+			{load_error, Error}
 	end.
 
 eval(Pid, Code, Timeout) ->
-	Result = gen_server:call(Pid, {eval, Code, self()}, Timeout),
+	eval(Pid, Code, #{}, Timeout).
+
+%% Bindings are names the chunk sees as globals; the code stays the same
+%% from call to call, so its compiled form is reused.
+eval(Pid, Code, Bindings, Timeout) ->
+	Deadline = deadline(Timeout),
+	Ref = make_ref(),
+	VM = vm_handle(Pid),
+	try moon_nif:eval(VM, to_binary(Code), {self(), Ref}, remaining(Deadline), flow(get(moon_tenant)), to_bindings(Bindings)) of
+		Result -> submitted(Result, VM, Ref, Deadline)
+	catch
+		_:Error ->
+			{eval_error, Error}
+	end.
 
-	case Result of
-		{ok, VM} ->
-			receive_response_call(Pid, #state{vm=VM, callback=undefined});
-		_ ->
-			Result
+call(Pid, Fun, Args, Timeout) when is_list(Args) ->
+	Deadline = deadline(Timeout),
+	Ref = make_ref(),
+	VM = vm_handle(Pid),
+	try moon_nif:call(VM, to_fun(Fun), Args, {self(), Ref}, remaining(Deadline), flow(get(moon_tenant))) of
+		Result -> submitted(Result, VM, Ref, Deadline)
+	catch
+		_:Error ->
+			{call_error, Error}
 	end.
 
-call(Pid, Fun, Args, Timeout) ->
-	Result = gen_server:call(Pid, {call, Fun, Args, self()}, Timeout),
+%% Queues the call and returns Ref right away; the reply, the same as
+%% call/4 would give, is collected with await/2. Timeout is the deadline
+%% of the task. A call that cannot be queued is answered at once.
+%% Its erlang.call callbacks are served by the VM owner, so the call
+%% goes on whether or not the caller is in await/2.
+call_async(Pid, Fun, Args, Timeout) when is_list(Args) ->
+	Ref = make_ref(),
+	VM = vm_handle(Pid),
+	try moon_nif:call(VM, to_fun(Fun), Args, {self(), Ref, async}, remaining(deadline(Timeout)), flow(get(moon_tenant))) of
+		ok -> ok;
+		Refused -> self() ! {moon_response, Ref, Refused}
+	catch
+		_:Error ->
+			self() ! {moon_response, Ref, {call_error, Error}}
+	end,
+	Ref.
+
+%% {error, timeout} leaves the call running; it can be awaited again.
+await(Ref, Timeout) ->
+	case receive_response(Ref, deadline(Timeout)) of
+		timeout -> {error, timeout};
+		Response -> Response
+	end.
+
+call_batch(Pid, Calls, Timeout) when is_list(Calls) ->
+	Deadline = deadline(Timeout),
+	Ref = make_ref(),
+	VM = vm_handle(Pid),
+	try moon_nif:call_batch(VM, [{to_fun(Fun), Args} || {Fun, Args} <- Calls], {self(), Ref}, remaining(Deadline), flow(get(moon_tenant))) of
+		Result -> submitted(Result, VM, Ref, Deadline)
+	catch
+		_:Error ->
+			{call_error, Error}
+	end.
 
-	case Result of 
-		{ok, VM} ->
-			receive_response_call(Pid, #state{vm=VM, callback=undefined});
-		_ -> Result
+%% Runs Fun on a dirty scheduler of the calling process, skipping the
+%% task queue and the moon_response round-trip; the caller is blocked in
+%% the NIF, so erlang.call callbacks are served by the VM owner.
+call_sync(Pid, Fun, Args) when is_list(Args) ->
+	moon_nif:call_sync(vm_handle(Pid), to_fun(Fun), Args).
+
+%% Resolves FunPath (a global or a dotted path such as mod.sub.fn) once;
+%% the handle can be given to call/call_batch/call_sync instead of a name
+%% and calls through it skip the lookup.
+prepare(Pid, FunPath) ->
+	case moon_nif:prepare(vm_handle(Pid), to_binary(FunPath)) of
+		{ok, Handle} -> {ok, {moon_fun, Handle}};
+		Error -> Error
 	end.
 
+%% Both read counters straight from the NIF resource.
+queue_len(Pid) ->
+	moon_nif:queue_len(vm_handle(Pid)).
+
+stats(Pid) ->
+	moon_nif:stats(vm_handle(Pid)).
 
 %%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%
 %% Private api:
 
+%% The NIF resource of every running VM is kept in the moon_vms table
+%% (see moon_vms),
+%% so finding it costs an ets lookup instead of a call to the owner.
+vm_handle(Name) when is_atom(Name) ->
+	vm_handle(whereis(Name));
+vm_handle(Pid) when is_pid(Pid) ->
+	case ets:lookup(?TABLE, Pid) of
+		[{_, VM}] ->
+			VM;
+		[] ->
+			% not published (yet); exits like a call to a dead VM would
+			{ok, VM} = gen_server:call(Pid, handle),
+			VM
+	end.
 
 %%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%
 
 init(Options) ->
-    Callback = proplists:get_value(callback, Options),
-    {ok, VM} = moon_nif:start(self()),
-    {ok, #state{vm=VM, callback=Callback}}.
-
-handle_call({load, File, Caller}, _, State=#state{vm=VM}) ->
-	try
-    	ok = moon_nif:load(VM, to_binary(File), Caller),
-    	{reply, {ok, VM}, State}
-	catch
-		_:Error ->
-			{reply, {load_error, Error}, State}
-	end;
+    % so that terminate/2 unpublishes the handle on shutdown
+    process_flag(trap_exit, true),
+    {ok, VM} = moon_nif:start(self(), Options),
+    {ok, publish(#state{vm=VM})}.
 
-handle_call({eval, Code, Caller}, _, State=#state{vm=VM}) ->
-	try 
-    	ok = moon_nif:eval(VM, to_binary(Code), Caller),
-    	{reply, {ok, VM}, State}
-	catch
-		_:Error ->
-			{reply, {eval_error, Error}, State}
-	end;
-
-handle_call({call, Fun, Args, Caller}, _, State=#state{vm=VM}) when is_list(Args) ->
-	try
-    	ok = moon_nif:call(VM, to_atom(Fun), Args, Caller),
-    	{reply, {ok, VM}, State}
-	catch
-		_:Error ->
-			{reply, {call_error, Error}, State}
-	end;	
-
-handle_call({callback, Callback, Args, VM, Caller}, _, State) ->
-    try
-        case handle_callback(Callback, Args) of
-            {error, Result} -> moon_nif:result(VM, [{error, true}, {result, Result}], Caller);
-            {ok, Result}    -> moon_nif:result(VM, [{error, false}, {result, Result}], Caller);
-            Result          -> moon_nif:result(VM, [{error, false}, {result, Result}], Caller)
-        end
-    catch 
-        _:Error ->
-            moon_nif:result(VM, [{error, true}, {result, Error}], Caller)
-    end,
-    {reply, ok, State};
+handle_call(handle, _, State=#state{vm=VM}) ->
+	{reply, {ok, VM}, State};
 
 handle_call(_, _, State) ->
   {reply, {call_error, no_right_param}, State}.
@@ -103,77 +160,132 @@ handle_call(_, _, State) ->
 handle_cast(_, State) ->
     {noreply, State}.
 
-handle_info({moon_callback, Args, Caller}, State=#state{vm=VM}) ->
-    try
-        true = erlang:is_process_alive(Caller),
-        case handle_callback(undefined, Args) of
-            {error, Result} -> moon_nif:result(VM, [{error, true}, {result, Result}], Caller);
-            {ok, Result}    -> moon_nif:result(VM, [{error, false}, {result, Result}], Caller);
-            Result          -> moon_nif:result(VM, [{error, false}, {result, Result}], Caller)
-        end
-    catch 
-        _:Error ->
-            moon_nif:result(VM, [{error, true}, {result, Error}], Caller)
-    end,
-
+handle_info({moon_callback, Args, Caller, Id}, State=#state{vm=VM}) ->
+    % only blocking erlang.calls (call_sync, load, user coroutines) and
+    % those of call_async land here; the callback runs outside the owner
+    % so that it never stalls
+    spawn(fun() -> reply_callback(VM, Args, Caller, Id) end),
     {noreply, State};
 
+handle_info({'DOWN', Monitor, process, _, _}, State=#state{registry=Monitor}) ->
+    erlang:send_after(?REPUBLISH_AFTER, self(), publish),
+    {noreply, State#state{registry=undefined}};
+
+handle_info(publish, State) ->
+    {noreply, publish(State)};
+
 handle_info(_, State) ->
     {noreply, State}.
 
 terminate(_, _) ->
-    ok.
+    moon_vms:unpublish(self()).
 
 code_change(_, State, _) ->
     {ok, State}.
 
 %%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%
 
-receive_response_self() ->
-    receive
-        {moon_response, Response, Caller} ->
-            Response
-	end.
+%% Puts the handle in the moon_vms table, again whenever moon_vms comes
+%% back from a restart with an empty one; retried until the table is there.
+publish(State=#state{vm=VM}) ->
+    Monitor = erlang:monitor(process, moon_vms),
+    try
+        moon_vms:publish(self(), VM),
+        State#state{registry=Monitor}
+    catch
+        error:badarg ->
+            erlang:demonitor(Monitor, [flush]),
+            erlang:send_after(?REPUBLISH_AFTER, self(), publish),
+            State#state{registry=undefined}
+    end.
 
-receive_response_call(Pid, State=#state{vm=VM, callback=Callback}) ->
+%% A suspended task's erlang.call comes back to its caller as a
+%% moon_callback, tagged like the reply of the task; it is run here while
+%% the caller waits anyway. Any other one is left over from a request
+%% that timed out: it is answered with an error, never run late.
+receive_response(Ref, Deadline) ->
     receive
-        {moon_response, Response, Caller} ->
+        {moon_response, Ref, Response} ->
             Response;
-        {moon_callback, Args, Caller} ->
-            gen_server:call(Pid, {callback, Callback, Args, VM, Caller}, infinity),
-            %%try
-            %%    case handle_callback(Callback, Args) of
-            %%        {error, Result} -> moon_nif:result(VM, [{error, true}, {result, Result}], Caller);
-            %%        {ok, Result}    -> moon_nif:result(VM, [{error, false}, {result, Result}], Caller);
-            %%        Result          -> moon_nif:result(VM, [{error, false}, {result, Result}], Caller)
-            %%    end
-            %%catch _:Error ->
-            %%    moon_nif:result(VM, [{error, true}, {result, Error}], Caller)
-            %%end,
-            receive_response_call(Pid, State)
+        {moon_callback, Args, Ref, Id, VM} ->
+            reply_callback(VM, Args, self(), Id),
+            receive_response(Ref, Deadline);
+        {moon_callback, _, _, Id, VM} ->
+            moon_nif:result(VM, [{error, true}, {result, timeout}], self(), Id),
+            receive_response(Ref, Deadline)
+    after remaining(Deadline) ->
+        timeout
     end.
 
-%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%
+%% After moon_nif:cancel/2 the VM drops the coroutines of a timed out
+%% request that wait on a callback, and neither starts the task nor lets
+%% it wait on another one; callbacks already here are thrown away.
+flush_callbacks(Ref) ->
+    receive
+        {moon_callback, _, Ref, _, _} ->
+            flush_callbacks(Ref)
+    after 0 ->
+        ok
+    end.
 
-handle_callback(undefined, {Mod, Fun, Args}) ->
-    erlang:apply(to_atom(Mod),to_atom(Fun),Args);
+%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%
 
-handle_callback(Callback, Args) when is_function(Callback) ->
-    Callback(Args);
+deadline(infinity) ->
+    infinity;
+deadline(Timeout) ->
+    erlang:monotonic_time(millisecond) + Timeout.
+
+remaining(infinity) ->
+    infinity;
+remaining(Deadline) ->
+    max(0, Deadline - erlang:monotonic_time(millisecond)).
+
+%% Fair queuing flow of a request: the tenant set with moon:set_tenant/2,
+%% or the calling process when there is none.
+flow(undefined) ->
+    {undefined, 1};
+flow({Tenant, Weight}) ->
+    {Tenant, Weight}.
+
+%% A full task queue answers {error, overloaded} right away.
+submitted(ok, VM, Ref, Deadline) ->
+	case receive_response(Ref, Deadline) of
+		timeout ->
+			moon_nif:cancel(VM, Ref),
+			flush_callbacks(Ref),
+			{error, timeout};
+		Response ->
+			Response
+	end;
+submitted(Error, _, _, _) ->
+	Error.
 
-handle_callback({Mod, Fun}, Args) when is_atom(Mod), is_atom(Fun) ->
-    erlang:apply(Mod, Fun, Args);
+%% Id is the request id of the moon_callback; the VM uses it to hand the
+%% reply to the erlang.call that is waiting for it.
+reply_callback(VM, Args, Caller, Id) ->
+    try
+        true = erlang:is_process_alive(Caller),
+        case handle_callback(Args) of
+            {error, Result} -> moon_nif:result(VM, [{error, true}, {result, Result}], Caller, Id);
+            {ok, Result}    -> moon_nif:result(VM, [{error, false}, {result, Result}], Caller, Id);
+            Result          -> moon_nif:result(VM, [{error, false}, {result, Result}], Caller, Id)
+        end
+    catch 
+        _:Error ->
+            moon_nif:result(VM, [{error, true}, {result, Error}], Caller, Id)
+    end.
 
-handle_callback({Mod, Fun, Args0}, Args1)
-        when is_atom(Mod), is_atom(Fun)
-           , is_list(Args0), is_list(Args1) ->
-    erlang:apply(Mod, Fun, Args0 ++ Args1);
+handle_callback({Mod, Fun, Args}) ->
+    erlang:apply(to_atom(Mod),to_atom(Fun),Args);
 
-handle_callback(_, _) ->
+handle_callback(_) ->
     error(invalid_call).
 
 %%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%
 
+to_fun({moon_fun, Handle}) -> Handle;
+to_fun(Fun) -> to_atom(Fun).
+
 to_atom(Val) when is_atom(Val) -> Val;
 to_atom(Val) when is_list(Val) -> list_to_atom(Val);
 to_atom(Val) when is_binary(Val) -> list_to_atom(binary_to_list(Val)).
@@ -181,3 +293,8 @@ to_atom(Val) when is_binary(Val) -> list_to_atom(binary_to_list(Val)).
 to_binary(Val) when is_binary(Val) -> Val;
 to_binary(Val) when is_atom(Val) -> list_to_binary(atom_to_list(Val));
 to_binary(Val) when is_list(Val) -> list_to_binary(Val).
+
+to_bindings(Bindings) when is_map(Bindings) ->
+	to_bindings(maps:to_list(Bindings));
+to_bindings(Bindings) when is_list(Bindings) ->
+	maps:from_list([{to_binary(Name), Value} || {Name, Value} <- Bindings]).
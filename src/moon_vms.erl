@@ -0,0 +1,64 @@
+-module(moon_vms).
+-behaviour(gen_server).
+
+%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%
+%% Owner of the moon_vms table: Pid -> NIF handle of every running VM, so
+%% that callers reach the NIF without a round-trip to the VM process.
+%% A VM that dies without running terminate/2 (killed, or brutally shut
+%% down) is taken out of the table here. The table goes with this process;
+%% the VMs watch it and publish themselves again after a restart.
+
+%% gen_server callbacks:
+-export([init/1, handle_call/3, handle_cast/2, handle_info/2, terminate/2, code_change/3]).
+
+%% api:
+-export([start_link/0]).
+-export([publish/2, unpublish/1]).
+
+%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%
+%% Public api:
+
+start_link() ->
+    gen_server:start_link({local, ?MODULE}, ?MODULE, [], []).
+
+%% Called by the VM process itself; the row is visible as soon as this
+%% returns, and the process is watched from then on.
+publish(Pid, VM) ->
+    ets:insert(?MODULE, {Pid, VM}),
+    gen_server:cast(?MODULE, {monitor, Pid}).
+
+unpublish(Pid) ->
+    ets:delete(?MODULE, Pid),
+    ok.
+
+%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%
+
+init([]) ->
+    ets:new(?MODULE, [named_table, public, set, {read_concurrency, true}]),
+    {ok, #{}}.
+
+handle_call(_, _, State) ->
+    {reply, {error, unknown_call}, State}.
+
+%% a VM that is already gone gets its 'DOWN' (noproc) right away
+handle_cast({monitor, Pid}, State) ->
+    erlang:monitor(process, Pid),
+    {noreply, State};
+
+handle_cast(_, State) ->
+    {noreply, State}.
+
+handle_info({'DOWN', _, process, Pid, _}, State) ->
+    ets:delete(?MODULE, Pid),
+    {noreply, State};
+
+handle_info(_, State) ->
+    {noreply, State}.
+
+terminate(_, _) ->
+    ok.
+
+code_change(_, State, _) ->
+    {ok, State}.
+
+%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%
@@ -0,0 +1,171 @@
+-module(moon_warm).
+-behaviour(gen_server).
+
+%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%
+%% Pools of VMs started and loaded ahead of time, one per template.
+%% A template is a spec such as
+%%   [{size, 4}, {options, VMOptions}, {load, [File]}, {eval, [Code]}]
+%% given in the moon env ({templates, [{Name, Spec}]}) or with add_template/2.
+%% checkout/1 hands out a ready VM and a new one is built in the background.
+
+%% gen_server callbacks:
+-export([init/1, handle_call/3, handle_cast/2, handle_info/2, terminate/2, code_change/3]).
+
+%% api:
+-export([start_link/0]).
+-export([add_template/2, remove_template/1, checkout/1]).
+-export([build/1]).
+
+%% id tells the builds of this template apart from those of one it replaced
+-record(template, {id, spec, ready = queue:new(), building = 0}).
+
+-define(DEFAULT_SIZE, 4).
+-define(RETRY_AFTER, 1000).
+
+%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%
+%% Public api:
+
+start_link() ->
+    gen_server:start_link({local, ?MODULE}, ?MODULE, [], []).
+
+add_template(Name, Spec) when is_list(Spec) ->
+    gen_server:call(?MODULE, {add_template, Name, Spec}).
+
+%% The VMs still in the pool are stopped; checked out ones are not touched.
+remove_template(Name) ->
+    gen_server:call(?MODULE, {remove_template, Name}).
+
+%% {ok, Pid}, owned by the caller from now on (stop it with moon:stop_vm/1).
+%% When the pool has run dry the VM is built by the calling process.
+checkout(Name) ->
+    case gen_server:call(?MODULE, {checkout, Name}) of
+        {build, Spec} -> build(Spec);
+        Result -> Result
+    end.
+
+%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%
+
+init([]) ->
+    process_flag(trap_exit, true),
+    Templates = application:get_env(moon, templates, []),
+    {ok, lists:foldl(fun({Name, Spec}, State) -> refill(Name, State#{Name => new(Spec)}) end,
+                     #{}, Templates)}.
+
+handle_call({add_template, Name, Spec}, _, State) ->
+    State1 = stop_ready(Name, State),
+    {reply, ok, refill(Name, State1#{Name => new(Spec)})};
+
+handle_call({remove_template, Name}, _, State) ->
+    {reply, ok, maps:remove(Name, stop_ready(Name, State))};
+
+handle_call({checkout, Name}, _, State) ->
+    case maps:find(Name, State) of
+        {ok, T=#template{spec=Spec, ready=Ready}} ->
+            case queue:out(Ready) of
+                {{value, {Pid, Monitor}}, Ready1} ->
+                    erlang:demonitor(Monitor, [flush]),
+                    {reply, {ok, Pid}, refill(Name, State#{Name => T#template{ready=Ready1}})};
+                {empty, _} ->
+                    {reply, {build, Spec}, State}
+            end;
+        error ->
+            {reply, {error, unknown_template}, State}
+    end;
+
+handle_call(_, _, State) ->
+    {reply, {error, no_right_param}, State}.
+
+handle_cast(_, State) ->
+    {noreply, State}.
+
+handle_info({built, Name, Id, Result}, State) ->
+    case maps:find(Name, State) of
+        {ok, T=#template{id=Id, ready=Ready, building=Building}} ->
+            T1 = T#template{building=Building - 1},
+            case Result of
+                {ok, Pid} ->
+                    Entry = {Pid, erlang:monitor(process, Pid)},
+                    {noreply, refill(Name, State#{Name => T1#template{ready=queue:in(Entry, Ready)}})};
+                {error, Reason} ->
+                    error_logger:error_msg("moon: cannot build a VM of template ~p: ~p~n", [Name, Reason]),
+                    erlang:send_after(?RETRY_AFTER, self(), {refill, Name}),
+                    {noreply, State#{Name => T1}}
+            end;
+        _ ->
+            % the template was removed or replaced meanwhile
+            stop_vm(Result),
+            {noreply, State}
+    end;
+
+handle_info({refill, Name}, State) ->
+    {noreply, refill(Name, State)};
+
+handle_info({'DOWN', Monitor, process, _, _}, State) ->
+    % an idle VM died, replace it
+    Down = fun(Name, T=#template{ready=Ready}, Acc) ->
+        Ready1 = queue:filter(fun({_, M}) -> M =/= Monitor end, Ready),
+        case queue:len(Ready1) =:= queue:len(Ready) of
+            true -> Acc;
+            false -> refill(Name, Acc#{Name => T#template{ready=Ready1}})
+        end
+    end,
+    {noreply, maps:fold(Down, State, State)};
+
+handle_info(_, State) ->
+    {noreply, State}.
+
+terminate(_, State) ->
+    maps:fold(fun(Name, _, Acc) -> stop_ready(Name, Acc) end, State, State),
+    ok.
+
+code_change(_, State, _) ->
+    {ok, State}.
+
+%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%
+
+%% Starts a builder for every VM the pool is missing; they run outside the
+%% server so that checkouts are never held up by a load.
+refill(Name, State) ->
+    case maps:find(Name, State) of
+        {ok, T=#template{id=Id, spec=Spec, ready=Ready, building=Building}} ->
+            Missing = max(0, proplists:get_value(size, Spec, ?DEFAULT_SIZE) - queue:len(Ready) - Building),
+            Self = self(),
+            [spawn(fun() -> Self ! {built, Name, Id, build(Spec)} end) || _ <- lists:seq(1, Missing)],
+            State#{Name => T#template{building=Building + Missing}};
+        error ->
+            State
+    end.
+
+new(Spec) ->
+    #template{id=make_ref(), spec=Spec}.
+
+stop_ready(Name, State) ->
+    case maps:find(Name, State) of
+        {ok, T=#template{ready=Ready}} ->
+            [begin erlang:demonitor(M, [flush]), moon_sup:stop_child(Pid) end || {Pid, M} <- queue:to_list(Ready)],
+            State#{Name => T#template{ready=queue:new()}};
+        error ->
+            State
+    end.
+
+%% A VM started and loaded as Spec says; used by moon_pool as well.
+build(Spec) ->
+    case moon_sup:start_child([proplists:get_value(options, Spec, [])]) of
+        {ok, Pid} ->
+            try
+                [ok = moon:load(Pid, File) || File <- proplists:get_value(load, Spec, [])],
+                [{ok, _} = moon:eval(Pid, Code) || Code <- proplists:get_value(eval, Spec, [])],
+                {ok, Pid}
+            catch
+                _:Error ->
+                    moon_sup:stop_child(Pid),
+                    {error, Error}
+            end;
+        Error ->
+            Error
+    end.
+
+stop_vm({ok, Pid}) ->
+    moon_sup:stop_child(Pid);
+stop_vm(_) ->
+    ok.
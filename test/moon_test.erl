@@ -1,6 +1,8 @@
 -module(moon_test).
 -include_lib("eunit/include/eunit.hrl").
 
+-export([hold/0]).
+
 the_test_() ->
     {foreach,
         fun setup/0,
@@ -19,8 +21,23 @@ the_test_() ->
                     ?assertMatch({ok, true}, moon:call(vm, test, [42, <<"number">>])),
                     ?assertMatch({ok, true}, moon:call(vm, test, [42.5, <<"number">>])),
                     ?assertMatch({ok, true}, moon:call(vm, test, [hello, <<"string">>])),
+                    ?assertMatch({ok, true}, moon:call(vm, test, [undefined, <<"nil">>])),
+                    ?assertMatch({ok, true}, moon:call(vm, test, [null, <<"nil">>])),
                     ?assertMatch({ok, true}, moon:call(vm, test, [<<"hello">>, <<"string">>])),
-                    ?assertMatch({ok, true}, moon:call(vm, test, [[], <<"table">>]))
+                    ?assertMatch({ok, true}, moon:call(vm, test, [[], <<"table">>])),
+                    ?assertMatch({ok, true}, moon:call(vm, test, [{1, 2}, <<"table">>])),
+                    ?assertMatch({ok, true}, moon:call(vm, test, [self(), <<"userdata">>])),
+                    ?assertMatch({ok, undefined}, moon:eval(vm, <<"function nested(T) return T.a[2] + T.b[1] + #T end">>)),
+                    ?assertMatch({ok, 7}, moon:call(vm, nested, [[{a, [1, 2]}, {b, {3}}, 4, {}, 5]])),
+                    ?assertMatch({ok, undefined}, moon:eval(vm, <<"function len(S) return #S end">>)),
+                    ?assertMatch({ok, 4194304}, moon:call(vm, len, [binary:copy(<<"x">>, 4194304)])),
+                    ?assertMatch({ok, 7}, moon:call(vm, nested, [#{a => [1, 2], b => #{1 => 3}, 1 => 4, 2 => 5}])),
+                    ?assertMatch({ok, undefined}, moon:eval(vm, <<"function total(T) local s = 0 for i = 1, #T do s = s + (tonumber(T[i]) or #T[i]) end return s end">>)),
+                    ?assertMatch({ok, 50005000}, moon:call(vm, total, [lists:seq(1, 10000)])),
+                    ?assertMatch({ok, 3000}, moon:call(vm, total, [lists:duplicate(1000, <<"abc">>)])),
+                    ?assertMatch({ok, 4.5}, moon:call(vm, total, [[1, 2.5, <<"a">>, {2.5, 2}]])),
+                    ?assertMatch({ok, undefined}, moon:eval(vm, <<"function names(L) local s = '' for _, R in ipairs(L) do s = s .. R.name end return s end">>)),
+                    ?assertMatch({ok, <<"abab">>}, moon:call(vm, names, [[[{name, a}], [{name, b}], [{name, a}], [{name, b}]]]))
                 end
             },
             {"Lua -> Erlang type mapping",
@@ -46,6 +63,11 @@ the_test_() ->
 						moon:eval(vm, <<"return {ugly=\"mixed\", \"list\", {x=1}}">>)),
                     ?assertMatch({ok, [{}]},
                                  moon:eval(vm, <<"do a={}; b={is_hash=true}; setmetatable(a,b); return a;  end">>)),
+                    Seq = lists:seq(1, 1000),
+                    ?assertMatch({ok, Seq},
+                                 moon:eval(vm, <<"local t = {} for i = 1, 1000 do t[i] = i end return t">>)),
+                    ?assertMatch({ok, [<<"(table_self)">>]},
+                                 moon:eval(vm, <<"local t = {} t[1] = t return t">>)),
 
                     Script = <<"function pid_test(pid) return pid end">>,
                     ?assertMatch({ok, undefined}, moon:eval(vm, Script)),
@@ -57,6 +79,308 @@ the_test_() ->
                     ?assertMatch({ok, ok}, moon:eval(vm, "return erlang.atom('ok', 'false')"))
 
                 end
+            },
+            {"Lua hash tables as maps",
+                fun() ->
+                    {ok, Maps} = moon:start_vm([{return_maps, true}]),
+                    ?assertMatch({ok, #{<<"yet">> := <<"value">>, <<"another">> := #{<<"x">> := 1}}},
+                        moon:eval(Maps, <<"return {yet=\"value\", another={x=1}}">>)),
+                    ?assertMatch({ok, #{1 := <<"list">>, <<"ugly">> := <<"mixed">>}},
+                        moon:eval(Maps, <<"return {ugly=\"mixed\", \"list\"}">>)),
+                    ?assertMatch({ok, [10, 100]}, moon:eval(Maps, <<"return {10, 100}">>)),
+                    ?assertEqual({ok, #{}}, moon:eval(Maps, <<"return setmetatable({}, {is_hash=true})">>)),
+                    ok = moon:stop_vm(Maps)
+                end
+            },
+            {"Batched calls",
+                fun() ->
+                    ?assertMatch({ok, undefined}, moon:eval(vm, <<"function twice(A) return A * 2 end">>)),
+                    ?assertMatch({ok, [{ok, 2}, {ok, 4}, {error_lua, _}, {ok, 8}]},
+                        moon:call_batch(vm, [{twice, [1]}, {twice, [2]}, {twice, [<<"x">>]}, {<<"twice">>, [4]}])),
+                    ?assertMatch({ok, []}, moon:call_batch(vm, []))
+                end
+            },
+            {"Synchronous call",
+                fun() ->
+                    ?assertMatch({ok, undefined}, moon:eval(vm, <<"function sum(A, B) return A + B end">>)),
+                    ?assertMatch({ok, 5}, moon:call_sync(vm, sum, [2, 3])),
+                    ?assertMatch({error_lua, _}, moon:call_sync(vm, sum, [2])),
+                    ?assertMatch({ok, undefined}, moon:eval(vm, <<"function cb() return erlang.call('erlang', 'self', {}).error and 'error' or 'ok' end">>)),
+                    ?assertMatch({ok, <<"ok">>}, moon:call_sync(vm, cb, []))
+                end
+            },
+            {"Prepared functions",
+                fun() ->
+                    ?assertMatch({ok, undefined}, moon:eval(vm, <<"mod = {sub = {fn = function(A, B) return A * B end}} function inc(A) return A + 1 end">>)),
+                    {ok, Fn} = moon:prepare(vm, "mod.sub.fn"),
+                    {ok, Inc} = moon:prepare(vm, inc),
+                    ?assertMatch({ok, 6}, moon:call(vm, Fn, [2, 3])),
+                    ?assertMatch({ok, 2}, moon:call(vm, Inc, [1])),
+                    ?assertMatch({ok, 3}, moon:call_sync(vm, Inc, [2])),
+                    ?assertMatch({ok, [{ok, 20}, {ok, 5}]}, moon:call_batch(vm, [{Fn, [4, 5]}, {Inc, [4]}])),
+                    ?assertEqual({error, not_a_function}, moon:prepare(vm, "mod.nothing.here")),
+                    ?assertEqual({error, not_a_function}, moon:prepare(vm, "mod.sub")),
+                    % the handle keeps the function it was prepared with
+                    ?assertMatch({ok, undefined}, moon:eval(vm, <<"function inc(A) return A + 2 end">>)),
+                    ?assertMatch({ok, 2}, moon:call(vm, Inc, [1]))
+                end
+            },
+            {"Edited files are loaded again",
+                fun() ->
+                    File = filename:join("/tmp", "moon_reload_" ++ os:getpid() ++ ".lua"),
+                    ok = file:write_file(File, <<"reloaded = 1">>),
+                    ?assertEqual(ok, moon:load(vm, File)),
+                    % same size, most likely the same second
+                    ok = file:write_file(File, <<"reloaded = 2">>),
+                    ?assertEqual(ok, moon:load(vm, File)),
+                    ?assertEqual({ok, 2}, moon:eval(vm, <<"return reloaded">>)),
+                    ok = file:delete(File)
+                end
+            },
+            {"Libraries opened on demand",
+                fun() ->
+                    {ok, Lazy} = moon:start_vm(),
+                    ?assertMatch({ok, true}, moon:eval(Lazy, <<"return package.loaded.cjson == nil and getmetatable(_G) == nil">>)),
+                    % a script may own the _G metatable, strict.lua style
+                    ?assertMatch({ok, undefined}, moon:eval(Lazy, <<"setmetatable(_G, {__index = function(_, K) error('undeclared ' .. K) end}); Early = cjson">>)),
+                    ?assertMatch({ok, <<"[1]">>}, moon:eval(Lazy, <<"return Early.encode({1})">>)),
+                    ?assertMatch({ok, true}, moon:eval(Lazy, <<"return package.loaded.cjson == cjson">>)),
+                    {ok, Decode} = moon:prepare(Lazy, "xml.eval"),
+                    ?assertMatch({ok, _}, moon:call(Lazy, Decode, [<<"<a/>">>])),
+                    ?assertMatch({ok, <<"table">>}, moon:eval(Lazy, <<"return type(require('protobuf.c'))">>)),
+                    % libraries that register their own globals, as before
+                    ?assertMatch({ok, true}, moon:eval(Lazy, <<"return protobuf.c == require('protobuf.c') and type(io.write) == 'function'">>)),
+                    ok = moon:stop_vm(Lazy),
+                    {ok, Eager} = moon:start_vm([{libs, [cjson, os]}]),
+                    ?assertMatch({ok, true}, moon:eval(Eager, <<"return rawget(_G, 'cjson') ~= nil and rawget(_G, 'os') ~= nil">>)),
+                    ok = moon:stop_vm(Eager),
+                    ?assertMatch({error, _}, moon:start_vm([{libs, [nope]}]))
+                end
+            },
+            {"Warm VM templates",
+                fun() ->
+                    ok = moon:add_template(greeter, [{size, 1}, {eval, [<<"function hi(N) return 'hi ' .. N end">>]}]),
+                    {ok, First} = moon:checkout_vm(greeter),
+                    % the pool is empty right after, so this one is built on the spot
+                    {ok, Second} = moon:checkout_vm(greeter),
+                    ?assertNotEqual(First, Second),
+                    ?assertMatch({ok, <<"hi a">>}, moon:call(First, hi, [<<"a">>])),
+                    ?assertMatch({ok, <<"hi b">>}, moon:call(Second, hi, [<<"b">>])),
+                    ok = moon:stop_vm(First),
+                    ok = moon:stop_vm(Second),
+                    ok = moon:remove_template(greeter),
+                    ?assertEqual({error, unknown_template}, moon:checkout_vm(greeter))
+                end
+            },
+            {"Named pools",
+                fun() ->
+                    {ok, _} = moon:start_pool(workers, 3, [{eval, [<<"count = 0 function bump() count = count + 1 return count end">>]}]),
+                    ?assertEqual({error, already_started}, moon:start_pool(workers, 1, [])),
+                    ?assertMatch({ok, [{ok, undefined}, {ok, undefined}, {ok, undefined}]},
+                                 moon:eval_all(workers, <<"function id() return tostring(erlang) end">>)),
+                    ?assertMatch({ok, 1}, moon:call(workers, bump, [])),
+                    % the same key always lands on the same VM
+                    {ok, N} = moon:call_keyed(workers, <<"player:1">>, bump, []),
+                    ?assertEqual({ok, N + 1}, moon:call_keyed(workers, <<"player:1">>, bump, [])),
+                    {ok, Ids} = moon:eval_all(workers, <<"return id()">>),
+                    ?assertEqual(3, length(lists:usort(Ids))),
+                    ok = moon:stop_pool(workers),
+                    ?assertEqual({error, not_found}, moon:call_keyed(workers, 1, bump, []))
+                end
+            },
+            {"Autoscaled pools",
+                fun() ->
+                    Spin = <<"function spin(N) local t = os.clock() while os.clock() - t < N do end return N end">>,
+                    {ok, _} = moon:start_pool(elastic, 1, [{eval, [Spin]}, {autoscale, [{min, 1}, {max, 3}, {interval, 100}]}]),
+                    Self = self(),
+                    [spawn(fun() -> Self ! {spin, moon:call(elastic, spin, [0.1])} end) || _ <- lists:seq(1, 20)],
+                    ?assert(wait_until(fun() -> length(pool_members(elastic)) =:= 3 end, 5000)),
+                    Grown = pool_members(elastic),
+                    [receive {spin, Result} -> ?assertMatch({ok, _}, Result) after 10000 -> ?assert(false) end || _ <- lists:seq(1, 20)],
+                    % idle again: drained and stopped one by one, down to min
+                    ?assert(wait_until(fun() -> length(pool_members(elastic)) =:= 1 end, 10000)),
+                    ?assert(wait_until(fun() -> length([Pid || Pid <- Grown, is_process_alive(Pid)]) =:= 1 end, 5000)),
+                    ok = moon:stop_pool(elastic)
+                end
+            },
+            {"Requests bypass the VM owner",
+                fun() ->
+                    Owner = whereis(vm),
+                    ok = sys:suspend(Owner),
+                    ?assertMatch({ok, undefined}, moon:eval(vm, <<"function add(A, B) return A + B end">>)),
+                    ?assertMatch({ok, 3}, moon:call(vm, add, [1, 2])),
+                    Self = self(),
+                    ?assertMatch({ok, Self}, moon:eval(vm, <<"return erlang.call('erlang', 'self', {}).result">>)),
+                    ok = sys:resume(Owner)
+                end
+            },
+            {"Pipelined async calls",
+                fun() ->
+                    ?assertMatch({ok, undefined}, moon:eval(vm, <<"function echo_later(N) erlang.call('timer', 'sleep', {50}) return N end">>)),
+                    Refs = [{N, moon:call_async(vm, echo_later, [N])} || N <- lists:seq(1, 10)],
+                    % awaited out of order, each reply still finds its own request
+                    [?assertEqual({ok, N}, moon:await(Ref, 1000)) || {N, Ref} <- lists:reverse(Refs)],
+                    Slow = moon:call_async(vm, echo_later, [slow]),
+                    ?assertEqual({error, timeout}, moon:await(Slow, 0)),
+                    ?assertEqual({ok, <<"slow">>}, moon:await(Slow, 1000)),
+                    % the callback is served before the caller ever awaits
+                    ?assertMatch({ok, undefined}, moon:eval(vm, <<"function notify(P) erlang.call('erlang', 'send', {P, 42}) return 'done' end">>)),
+                    Notify = moon:call_async(vm, notify, [self()]),
+                    ?assertEqual(notified, receive 42 -> notified after 1000 -> timeout end),
+                    ?assertEqual({ok, <<"done">>}, moon:await(Notify, 1000))
+                end
+            },
+            {"Eval with bindings",
+                fun() ->
+                    Code = <<"greeting = 'hi' return name .. ':' .. n * 2">>,
+                    ?assertEqual({ok, <<"a:2">>}, moon:eval(vm, Code, #{name => <<"a">>, n => 1})),
+                    ?assertEqual({ok, <<"b:4">>}, moon:eval(vm, Code, [{"name", <<"b">>}, {n, 2}])),
+                    % bindings are local to the chunk, other globals are shared
+                    ?assertMatch({ok, nil}, moon:eval(vm, <<"return name">>)),
+                    ?assertMatch({ok, <<"hi">>}, moon:eval(vm, <<"return greeting">>)),
+                    ?assertMatch({ok, 7}, moon:eval(vm, <<"return n">>, [{n, 7}], 5000))
+                end
+            },
+            {"Instruction and CPU budgets",
+                fun() ->
+                    {ok, Limited} = moon:start_vm([{max_instructions, 1000000}, {max_cpu_time, 1000}]),
+                    ?assertMatch({ok, undefined}, moon:eval(Limited, <<"function spin() while true do end end">>)),
+                    ?assertMatch({error_lua, timeout}, moon:call(Limited, spin, [])),
+                    ?assertMatch({error_lua, timeout}, moon:eval(Limited, <<"while true do pcall(spin) end">>)),
+                    % hot enough to be compiled if the JIT were left on
+                    ?assertMatch({error_lua, timeout}, moon:eval(Limited, <<"local n = 0 for i = 1, 1e15 do n = n + i % 7 end return n">>)),
+                    % the budget is not renewed by each callback
+                    ?assertMatch({ok, undefined}, moon:eval(Limited, <<"function chatty() while true do erlang.call('erlang', 'self', {}) for i = 1, 100000 do end end end">>)),
+                    ?assertMatch({error_lua, timeout}, moon:call(Limited, chatty, [])),
+                    ?assertMatch({ok, 42}, moon:eval(Limited, <<"return 42">>)),
+                    ok = moon:stop_vm(Limited)
+                end
+            },
+            {"Callbacks do not stall the VM",
+                fun() ->
+                    ?assertMatch({ok, undefined}, moon:eval(vm, <<"function slow() return erlang.call('moon_test', 'hold', {}).result end">>)),
+                    Self = self(),
+                    Caller = spawn(fun() -> Self ! {slow, moon:call(vm, slow, [])} end),
+                    ?assert(wait_until(fun() -> proplists:get_value(suspended, moon:stats(vm)) =:= 1 end, 5000)),
+                    % served while slow still waits on its callback
+                    ?assertMatch({ok, 1}, moon:eval(vm, <<"return 1">>)),
+                    ?assertEqual(waiting, receive {slow, _} -> done after 0 -> waiting end),
+                    Caller ! release,
+                    ?assertMatch({slow, {ok, <<"ok">>}}, receive Slow -> Slow after 5000 -> timeout end)
+                end
+            },
+            {"Callbacks across a C boundary",
+                fun() ->
+                    Code = <<"local t = {3, 1, 2} table.sort(t, function(a, b) return erlang.call('erlang', '<', {a, b}).result end) return t">>,
+                    ?assertMatch({ok, [1, 2, 3]}, moon:eval(vm, Code)),
+                    ?assertMatch({ok, <<"x11x">>}, moon:eval(vm, <<"return (string.gsub('x1x', '%d', function(d) return erlang.call('erlang', 'iolist_to_binary', {{d, d}}).result end))">>)),
+                    ?assertMatch({ok, 1}, moon:eval(vm, <<"return 1">>))
+                end
+            },
+            {"Correlated callback replies",
+                fun() ->
+                    ?assertMatch({ok, undefined}, moon:eval(vm, <<"function echo_slow(N) erlang.call('timer', 'sleep', {100}) return N end">>)),
+                    Self = self(),
+                    [spawn(fun() -> Self ! {echo, N, moon:call(vm, echo_slow, [N])} end) || N <- lists:seq(1, 5)],
+                    [?assertMatch({echo, N, {ok, N}}, receive {echo, N, _} = Echo -> Echo after 1000 -> timeout end) || N <- lists:seq(1, 5)]
+                end
+            },
+            {"Bounded queue",
+                fun() ->
+                    {ok, Small} = moon:start_vm([{queue_size, 2}]),
+                    ?assertMatch({ok, undefined}, moon:eval(Small, <<"function spin(N) local t = os.clock() while os.clock() - t < N do end return N end">>)),
+                    Self = self(),
+                    [spawn(fun() -> Self ! {spin, moon:call(Small, spin, [0.2])} end) || _ <- lists:seq(1, 6)],
+                    Results = [receive {spin, R} -> R after 3000 -> timeout end || _ <- lists:seq(1, 6)],
+                    ?assert(lists:member({error, overloaded}, Results)),
+                    ?assertEqual(0, moon:queue_len(Small)),
+                    Stats = moon:stats(Small),
+                    ?assertEqual(2, proplists:get_value(capacity, Stats)),
+                    ?assert(proplists:get_value(overloaded, Stats) > 0),
+                    ?assert(proplists:get_value(high_water, Stats) > 0),
+                    ?assertEqual({0, 0}, {proplists:get_value(running, Stats), proplists:get_value(suspended, Stats)}),
+                    ok = moon:stop_vm(Small),
+                    % the configured size is the limit, not the ring size
+                    {ok, Three} = moon:start_vm([{queue_size, 3}]),
+                    ?assertMatch({ok, undefined}, moon:eval(Three, <<"function spin(N) local t = os.clock() while os.clock() - t < N do end return N end">>)),
+                    spawn(fun() -> Self ! {spin, moon:call(Three, spin, [1])} end),
+                    ?assert(wait_until(fun() -> proplists:get_value(running, moon:stats(Three)) =:= 1 end, 5000)),
+                    [spawn(fun() -> Self ! {spin, moon:call(Three, spin, [0.01])} end) || _ <- lists:seq(1, 5)],
+                    Results3 = [receive {spin, R} -> R after 3000 -> timeout end || _ <- lists:seq(1, 6)],
+                    ?assertEqual(2, length([R || {error, overloaded} = R <- Results3])),
+                    ?assertEqual(3, proplists:get_value(capacity, moon:stats(Three))),
+                    ok = moon:stop_vm(Three)
+                end
+            },
+            {"Expired tasks are dropped",
+                fun() ->
+                    {ok, Busy} = moon:start_vm(),
+                    ?assertMatch({ok, undefined}, moon:eval(Busy, <<"function spin(N) local t = os.clock() while os.clock() - t < N do end return N end">>)),
+                    Self = self(),
+                    spawn(fun() -> Self ! {spin, moon:call(Busy, spin, [0.5])} end),
+                    ?assert(wait_until(fun() -> proplists:get_value(running, moon:stats(Busy)) =:= 1 end, 5000)),
+                    ?assertEqual({error, timeout}, moon:call(Busy, spin, [0], 100)),
+                    ?assertMatch({spin, {ok, _}}, receive Spin -> Spin after 5000 -> timeout end),
+                    ?assertMatch({ok, _}, moon:call(Busy, spin, [0])),
+                    ?assertEqual(1, proplists:get_value(expired, moon:stats(Busy))),
+                    ok = moon:stop_vm(Busy)
+                end
+            },
+            {"Timed out callers leave nothing behind",
+                fun() ->
+                    {ok, Late} = moon:start_vm(),
+                    ?assertMatch({ok, undefined}, moon:eval(Late, <<"function late() local t = os.clock() while os.clock() - t < 0.2 do end return erlang.call('erlang', 'self', {}) end">>)),
+                    % the callback comes after the caller gave up
+                    ?assertEqual({error, timeout}, moon:call(Late, late, [], 100)),
+                    ?assert(wait_until(fun() -> idle(Late) end, 5000)),
+                    exit(Late, kill),
+                    ?assert(wait_until(fun() -> ets:lookup(moon_vms, Late) =:= [] end, 5000))
+                end
+            },
+            {"Handles are published again after moon_vms restarts",
+                fun() ->
+                    Pid = whereis(vm),
+                    exit(whereis(moon_vms), kill),
+                    ?assert(wait_until(fun() -> ets:info(moon_vms) =/= undefined andalso ets:lookup(moon_vms, Pid) =/= [] end, 5000)),
+                    ?assertMatch({ok, 3}, moon:eval(vm, <<"return 1 + 2">>))
+                end
+            },
+            {"Fair queuing",
+                fun() ->
+                    {ok, Fair} = moon:start_vm([{fair_queuing, true}]),
+                    ?assertMatch({ok, undefined}, moon:eval(Fair, <<"function spin(N) local t = os.clock() while os.clock() - t < N do end return N end">>)),
+                    Self = self(),
+                    % a batch tenant floods the vm before an interactive caller shows up
+                    [spawn(fun() -> ok = moon:set_tenant(batch), Self ! {batch, moon:call(Fair, spin, [0.05])} end) || _ <- lists:seq(1, 10)],
+                    ?assert(wait_until(fun() -> moon:queue_len(Fair) >= 8 end, 5000)),
+                    ?assertMatch({ok, _}, moon:call(Fair, spin, [0])),
+                    % served after a couple of batch tasks, not behind all of them
+                    Before = count_received(batch),
+                    ?assert(Before < 5),
+                    [receive {batch, _} -> ok after 5000 -> timeout end || _ <- lists:seq(Before + 1, 10)],
+                    ok = moon:stop_vm(Fair)
+                end
+            },
+            {"Large binaries as buffers",
+                fun() ->
+                    {ok, Buf} = moon:start_vm([{buffer_threshold, 1024}]),
+                    ?assertMatch({ok, undefined}, moon:eval(Buf, <<"function buf(B) local cjson = require('cjson') return type(B), #B, B:sub(2, 3), tostring(B:sub(-2)), cjson.decode(B)[1] end">>)),
+                    Json = <<"[", (binary:copy(<<"7,">>, 600))/binary, "7]">>,
+                    ?assertMatch({ok, {<<"userdata">>, 1203, <<"7,">>, <<"7]">>, 7}}, moon:call(Buf, buf, [Json])),
+                    ?assertMatch({ok, {<<"string">>, 3, _, _, 7}}, moon:call(Buf, buf, [<<"[7]">>])),
+                    ?assertMatch({ok, undefined}, moon:eval(Buf, <<"function echo(B) return B end">>)),
+                    ?assertEqual({ok, Json}, moon:call(Buf, echo, [Json])),
+                    ok = moon:stop_vm(Buf)
+                end
+            },
+            {"Pooled runtime",
+                fun() ->
+                    {ok, Pooled} = moon:start_vm([{runtime, pooled}]),
+                    ?assertMatch({ok, undefined}, moon:eval(Pooled, <<"function add(A, B) return A + B end">>)),
+                    ?assertMatch({ok, 3}, moon:call(Pooled, add, [1, 2])),
+                    ?assertMatch({ok, <<"ok">>}, moon:eval(Pooled, <<"return erlang.call('erlang', 'self', {}).error and 'error' or 'ok'">>)),
+                    ok = moon:stop_vm(Pooled)
+                end
             }
         ]
     }.
@@ -73,4 +397,33 @@ teardown(_) ->
     ok = moon:stop_vm(whereis(vm)),
     application:stop(moon).
 
+%% erlang.call target that blocks its caller until it gets release.
+hold() ->
+    receive release -> ok end.
+
+count_received(Tag) ->
+    receive {Tag, _} -> 1 + count_received(Tag) after 0 -> 0 end.
+
+pool_members(Name) ->
+    {ok, Members} = moon_pool:members(Name),
+    Members.
+
+idle(VM) ->
+    Stats = moon:stats(VM),
+    lists:all(fun(Key) -> proplists:get_value(Key, Stats) =:= 0 end, [queue_len, running, suspended]).
+
+%% Polls Fun until it holds or Timeout ms have passed, so that tests wait
+%% for a state instead of sleeping a fixed time.
+wait_until(Fun, Timeout) ->
+    Deadline = erlang:monotonic_time(millisecond) + Timeout,
+    wait_until(Fun, Deadline, Fun()).
+
+wait_until(_, _, true) ->
+    true;
+wait_until(Fun, Deadline, false) ->
+    case erlang:monotonic_time(millisecond) >= Deadline of
+        true -> false;
+        false -> timer:sleep(10), wait_until(Fun, Deadline, Fun())
+    end.
+
 %%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%